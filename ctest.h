@@ -18,8 +18,14 @@
 
 #ifdef __GNUC__
 #define CTEST_IMPL_FORMAT_PRINTF(a, b) __attribute__ ((format(printf, a, b)))
+#define CTEST_IMPL_NORETURN __attribute__ ((noreturn))
+#define CTEST_IMPL_COLD __attribute__ ((cold, noinline, noreturn))
+#define CTEST_IMPL_UNLIKELY(x) __builtin_expect(!!(x), 0)
 #else
 #define CTEST_IMPL_FORMAT_PRINTF(a, b)
+#define CTEST_IMPL_NORETURN
+#define CTEST_IMPL_COLD
+#define CTEST_IMPL_UNLIKELY(x) (x)
 #endif
 
 #include <inttypes.h> /* intmax_t, uintmax_t, PRI* */
@@ -27,6 +33,7 @@
 
 typedef void (*ctest_setup_func)(void*);
 typedef void (*ctest_teardown_func)(void*);
+typedef void (*ctest_thread_func)(int index, void* arg);
 
 #define CTEST_IMPL_PRAGMA(x) _Pragma (#x)
 
@@ -62,6 +69,24 @@ struct ctest {
     ctest_teardown_func* teardown;
 
     int skip;
+    int bench;      // run() takes an iteration count, only run with --bench
+    unsigned int timeout;   // ms, 0 means the --timeout default
+    const char* tags;       // comma separated, can be selected with --filter=@tag
+    size_t alloc_limit;     // bytes run() may allocate + 1, 0 means no limit (CTEST_MEMORY)
+
+    // CTEST_PARAM: the rows of param_table become separate tests at startup
+    const void* param_table;
+    size_t param_count;
+    size_t param_stride;
+    const void* param;      // the row this entry runs with
+
+    unsigned int iterations;    // CTEST_PROPERTY: runs of the body with new values
+    int suite_fixture;      // a CTEST_SUITE_SETUP/TEARDOWN entry instead of a test
+
+    // CTEST_STRESS: run() is called on stress_threads threads, for stress_ms or stress_count calls each
+    int stress_threads;
+    unsigned int stress_ms;
+    size_t stress_count;
 
     unsigned int magic;
 };
@@ -82,10 +107,12 @@ CTEST_IMPL_DIAG_POP()
 #ifdef __APPLE__
 #define CTEST_IMPL_SECTION __attribute__ ((used, section ("__DATA, .ctest"), aligned(1)))
 #else
-#define CTEST_IMPL_SECTION __attribute__ ((used, section (".ctest"), aligned(1)))
+/* a section name that is a valid identifier gets __start_ and __stop_ symbols from the linker */
+#define CTEST_IMPL_SECTION __attribute__ ((used, section ("ctest")))
 #endif
 
-#define CTEST_IMPL_STRUCT(sname, tname, tskip, tdata, tsetup, tteardown) \
+// the variable arguments are extra designated initializers (eg .bench = 1)
+#define CTEST_IMPL_STRUCT(sname, tname, tskip, tdata, tsetup, tteardown, ...) \
     static struct ctest CTEST_IMPL_TNAME(sname, tname) CTEST_IMPL_SECTION = { \
         .ssname=#sname, \
         .ttname=#tname, \
@@ -94,7 +121,8 @@ CTEST_IMPL_DIAG_POP()
         .setup = (ctest_setup_func*) tsetup, \
         .teardown = (ctest_teardown_func*) tteardown, \
         .skip = tskip, \
-        .magic = CTEST_IMPL_MAGIC }
+        .magic = CTEST_IMPL_MAGIC, \
+        __VA_ARGS__ }
 
 #define CTEST_SETUP(sname) \
     static void CTEST_IMPL_SETUP_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
@@ -106,34 +134,213 @@ CTEST_IMPL_DIAG_POP()
     static void (*CTEST_IMPL_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*) = &CTEST_IMPL_TEARDOWN_FNAME(sname); \
     static void CTEST_IMPL_TEARDOWN_FNAME(sname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
+/*
+ * Suite fixtures run once: the setup before the first test of the suite that
+ * runs, the teardown after its last one. They are entries in the test table
+ * too, so they work for CTEST and CTEST2 suites and can be defined anywhere.
+ */
+#define CTEST_IMPL_SUITE_SETUP 1
+#define CTEST_IMPL_SUITE_TEARDOWN 2
+
+#define CTEST_IMPL_SUITE_FIXTURE(sname, tname, kind) \
+    static void CTEST_IMPL_FNAME(sname, tname)(void); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, .suite_fixture = kind); \
+    static void CTEST_IMPL_FNAME(sname, tname)(void)
+
+#define CTEST_SUITE_SETUP(sname) CTEST_IMPL_SUITE_FIXTURE(sname, _suite_setup, CTEST_IMPL_SUITE_SETUP)
+#define CTEST_SUITE_TEARDOWN(sname) CTEST_IMPL_SUITE_FIXTURE(sname, _suite_teardown, CTEST_IMPL_SUITE_TEARDOWN)
+
 #define CTEST_DATA(sname) \
     struct CTEST_IMPL_DATA_SNAME(sname); \
     static void (*CTEST_IMPL_SETUP_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
     static void (*CTEST_IMPL_TEARDOWN_FPNAME(sname))(struct CTEST_IMPL_DATA_SNAME(sname)*); \
     struct CTEST_IMPL_DATA_SNAME(sname)
 
-#define CTEST_IMPL_CTEST(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST(sname, tname, tskip, ...) \
     static void CTEST_IMPL_FNAME(sname, tname)(void); \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, NULL, NULL, NULL, __VA_ARGS__); \
     static void CTEST_IMPL_FNAME(sname, tname)(void)
 
-#define CTEST_IMPL_CTEST2(sname, tname, tskip) \
+#define CTEST_IMPL_CTEST2(sname, tname, tskip, ...) \
     static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data); \
-    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname)); \
+    CTEST_IMPL_STRUCT(sname, tname, tskip, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname), __VA_ARGS__); \
     static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data)
 
+#define CTEST_IMPL_BENCH(sname, tname) \
+    static void CTEST_IMPL_FNAME(sname, tname)(size_t iterations); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, .bench = 1); \
+    static void CTEST_IMPL_FNAME(sname, tname)(size_t iterations)
+
+#define CTEST_IMPL_STRESS(sname, tname, threads, ...) \
+    static void CTEST_IMPL_FNAME(sname, tname)(int thread); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, .stress_threads = threads, __VA_ARGS__); \
+    static void CTEST_IMPL_FNAME(sname, tname)(int thread)
+
+#define CTEST_IMPL_STRESS2(sname, tname, threads, ...) \
+    static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, int thread); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname), \
+        .stress_threads = threads, __VA_ARGS__); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, int thread)
+
+#define CTEST_IMPL_BENCH2(sname, tname) \
+    static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, size_t iterations); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname), .bench = 1); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, size_t iterations)
+
 
+void CTEST_DEBUG(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
 void CTEST_LOG(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
-void CTEST_ERR(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);  // doesn't return
+void CTEST_WARN(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
+void CTEST_ERR(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2) CTEST_IMPL_NORETURN;
+
+/*
+ * Runs fn(index, arg) on 'count' new threads and waits for them. An assert
+ * that fails on one of them ends only that thread; the test fails after the
+ * join, with the messages of all threads.
+ */
+void ctest_run_threads(int count, ctest_thread_func fn, void* arg);
+
+#define CTEST(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0, )
+#define CTEST_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1, )
+#define CTEST_TIMEOUT(sname, tname, ms) CTEST_IMPL_CTEST(sname, tname, 0, .timeout = ms)
+#define CTEST_TAGGED(sname, tname, ttags) CTEST_IMPL_CTEST(sname, tname, 0, .tags = ttags)
+
+#define CTEST2(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0, )
+#define CTEST2_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1, )
+#define CTEST2_TIMEOUT(sname, tname, ms) CTEST_IMPL_CTEST2(sname, tname, 0, .timeout = ms)
+#define CTEST2_TAGGED(sname, tname, ttags) CTEST_IMPL_CTEST2(sname, tname, 0, .tags = ttags)
+
+// fails the test when run() allocates more than 'bytes' in total, needs CTEST_MEMORY
+#define CTEST_ALLOC_LIMIT(sname, tname, bytes) CTEST_IMPL_CTEST(sname, tname, 0, .alloc_limit = (size_t) (bytes) + 1)
+#define CTEST2_ALLOC_LIMIT(sname, tname, bytes) CTEST_IMPL_CTEST2(sname, tname, 0, .alloc_limit = (size_t) (bytes) + 1)
+
+/*
+ * Table driven tests: the body runs once for every row of 'table' (a static
+ * array), with 'param' pointing to the row. Each row is reported as its own
+ * test, named suite:test[row].
+ */
+#define CTEST_IMPL_PARAM(sname, tname, table) \
+    static void CTEST_IMPL_FNAME(sname, tname)(const __typeof__((table)[0])* param); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, NULL, NULL, NULL, \
+        .param_table = table, \
+        .param_count = sizeof(table) / sizeof((table)[0]), \
+        .param_stride = sizeof((table)[0])); \
+    static void CTEST_IMPL_FNAME(sname, tname)(const __typeof__((table)[0])* param)
+
+#define CTEST_IMPL_PARAM2(sname, tname, table) \
+    static struct CTEST_IMPL_DATA_SNAME(sname) CTEST_IMPL_DATA_TNAME(sname, tname); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, const __typeof__((table)[0])* param); \
+    CTEST_IMPL_STRUCT(sname, tname, 0, &CTEST_IMPL_DATA_TNAME(sname, tname), &CTEST_IMPL_SETUP_FPNAME(sname), &CTEST_IMPL_TEARDOWN_FPNAME(sname), \
+        .param_table = table, \
+        .param_count = sizeof(table) / sizeof((table)[0]), \
+        .param_stride = sizeof((table)[0])); \
+    static void CTEST_IMPL_FNAME(sname, tname)(struct CTEST_IMPL_DATA_SNAME(sname)* data, const __typeof__((table)[0])* param)
+
+#define CTEST_PARAM(sname, tname, table) CTEST_IMPL_PARAM(sname, tname, table)
+#define CTEST2_PARAM(sname, tname, table) CTEST_IMPL_PARAM2(sname, tname, table)
+
+/*
+ * Property tests: the body runs 'n' times, each time with new values from the
+ * ctest_gen_* generators. A failing input is shrunk to a minimal one, which is
+ * printed together with the seed to replay it (--seed).
+ */
+#define CTEST_PROPERTY(sname, tname, n) CTEST_IMPL_CTEST(sname, tname, 0, .iterations = n)
+#define CTEST2_PROPERTY(sname, tname, n) CTEST_IMPL_CTEST2(sname, tname, 0, .iterations = n)
+
+int64_t ctest_gen_int(int64_t min, int64_t max);
+double ctest_gen_double(double min, double max);
+// fills buf with 0..max_size random bytes, returns the size
+size_t ctest_gen_bytes(void* buf, size_t max_size);
+// a printable string of at most size-1 chars, returns the length
+size_t ctest_gen_string(char* buf, size_t size);
+
+/*
+ * Stress tests: the body is a single operation that runs over and over on
+ * 'threads' threads at once, for 'ms' milliseconds or, with the _COUNT forms,
+ * 'n' times per thread. 'thread' is the index of the calling thread. The
+ * result shows the throughput and the latency percentiles of the calls.
+ */
+#define CTEST_STRESS(sname, tname, threads, ms) CTEST_IMPL_STRESS(sname, tname, threads, .stress_ms = ms)
+#define CTEST_STRESS_COUNT(sname, tname, threads, n) CTEST_IMPL_STRESS(sname, tname, threads, .stress_count = n)
+#define CTEST2_STRESS(sname, tname, threads, ms) CTEST_IMPL_STRESS2(sname, tname, threads, .stress_ms = ms)
+#define CTEST2_STRESS_COUNT(sname, tname, threads, n) CTEST_IMPL_STRESS2(sname, tname, threads, .stress_count = n)
+
+// benchmarks: the body must perform the measured operation 'iterations' times
+#define CTEST_BENCH(sname, tname) CTEST_IMPL_BENCH(sname, tname)
+#define CTEST2_BENCH(sname, tname) CTEST_IMPL_BENCH2(sname, tname)
+
+// keeps the compiler from optimizing away a value computed in a benchmark
+#ifdef __GNUC__
+#define CTEST_BENCH_KEEP(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+#else
+#define CTEST_BENCH_KEEP(x) do { volatile const void* ctest_keep_ = &(x); (void)ctest_keep_; } while (0)
+#endif
+
+
+/*
+ * The common asserts are checked inline, so a passing assert costs one
+ * predicted branch. Formatting the error only happens in the ctest_impl_fail_*
+ * functions, which are kept out of line and marked cold.
+ */
+void ctest_impl_fail_equal(intmax_t exp, intmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_not_equal(intmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_not_equal_u(uintmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_dbl(double exp, double real, double tol, const char* caller, int line) CTEST_IMPL_COLD;
+void ctest_impl_fail_text(const char* text, const char* caller, int line) CTEST_IMPL_COLD;
+
+static inline void ctest_impl_assert_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(exp != real)) ctest_impl_fail_equal(exp, real, caller, line);
+}
+
+static inline void ctest_impl_assert_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(exp != real)) ctest_impl_fail_equal_u(exp, real, caller, line);
+}
+
+static inline void ctest_impl_assert_not_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(exp == real)) ctest_impl_fail_not_equal(real, caller, line);
+}
+
+static inline void ctest_impl_assert_not_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(exp == real)) ctest_impl_fail_not_equal_u(real, caller, line);
+}
+
+static inline void ctest_impl_assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(real < exp1 || real > exp2)) ctest_impl_fail_interval(exp1, exp2, real, caller, line);
+}
 
-#define CTEST(sname, tname) CTEST_IMPL_CTEST(sname, tname, 0)
-#define CTEST_SKIP(sname, tname) CTEST_IMPL_CTEST(sname, tname, 1)
+static inline void ctest_impl_assert_dbl_near(double exp, double real, double tol, const char* caller, int line) {
+    const double diff = exp - real;
+    /* avoid using fabs and linking with a math lib */
+    if (CTEST_IMPL_UNLIKELY((diff < 0 ? -diff : diff) > tol)) ctest_impl_fail_dbl(exp, real, tol, caller, line);
+}
+
+static inline void ctest_impl_assert_dbl_far(double exp, double real, double tol, const char* caller, int line) {
+    const double diff = exp - real;
+    if (CTEST_IMPL_UNLIKELY((diff < 0 ? -diff : diff) <= tol)) ctest_impl_fail_dbl(exp, real, tol, caller, line);
+}
+
+static inline void ctest_impl_assert_null(const void* real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(real != NULL)) ctest_impl_fail_text("should be NULL", caller, line);
+}
+
+static inline void ctest_impl_assert_not_null(const void* real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(real == NULL)) ctest_impl_fail_text("should not be NULL", caller, line);
+}
 
-#define CTEST2(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 0)
-#define CTEST2_SKIP(sname, tname) CTEST_IMPL_CTEST2(sname, tname, 1)
+static inline void ctest_impl_assert_true(int real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(real == 0)) ctest_impl_fail_text("should be true", caller, line);
+}
 
+static inline void ctest_impl_assert_false(int real, const char* caller, int line) {
+    if (CTEST_IMPL_UNLIKELY(real != 0)) ctest_impl_fail_text("should be false", caller, line);
+}
 
+// the out of line assert_* functions do the same checks
 void assert_str(const char* exp, const char* real, const char* caller, int line);
 #define ASSERT_STR(exp, real) assert_str(exp, real, __FILE__, __LINE__)
 
@@ -144,42 +351,90 @@ void assert_data(const unsigned char* exp, size_t expsize,
     assert_data(exp, expsize, real, realsize, __FILE__, __LINE__)
 
 void assert_equal(intmax_t exp, intmax_t real, const char* caller, int line);
-#define ASSERT_EQUAL(exp, real) assert_equal(exp, real, __FILE__, __LINE__)
+#define ASSERT_EQUAL(exp, real) ctest_impl_assert_equal(exp, real, __FILE__, __LINE__)
 
 void assert_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line);
-#define ASSERT_EQUAL_U(exp, real) assert_equal_u(exp, real, __FILE__, __LINE__)
+#define ASSERT_EQUAL_U(exp, real) ctest_impl_assert_equal_u(exp, real, __FILE__, __LINE__)
 
 void assert_not_equal(intmax_t exp, intmax_t real, const char* caller, int line);
-#define ASSERT_NOT_EQUAL(exp, real) assert_not_equal(exp, real, __FILE__, __LINE__)
+#define ASSERT_NOT_EQUAL(exp, real) ctest_impl_assert_not_equal(exp, real, __FILE__, __LINE__)
 
 void assert_not_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line);
-#define ASSERT_NOT_EQUAL_U(exp, real) assert_not_equal_u(exp, real, __FILE__, __LINE__)
+#define ASSERT_NOT_EQUAL_U(exp, real) ctest_impl_assert_not_equal_u(exp, real, __FILE__, __LINE__)
 
 void assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line);
-#define ASSERT_INTERVAL(exp1, exp2, real) assert_interval(exp1, exp2, real, __FILE__, __LINE__)
+#define ASSERT_INTERVAL(exp1, exp2, real) ctest_impl_assert_interval(exp1, exp2, real, __FILE__, __LINE__)
 
 void assert_null(void* real, const char* caller, int line);
-#define ASSERT_NULL(real) assert_null((void*)real, __FILE__, __LINE__)
+#define ASSERT_NULL(real) ctest_impl_assert_null((void*)real, __FILE__, __LINE__)
 
 void assert_not_null(const void* real, const char* caller, int line);
-#define ASSERT_NOT_NULL(real) assert_not_null(real, __FILE__, __LINE__)
+#define ASSERT_NOT_NULL(real) ctest_impl_assert_not_null(real, __FILE__, __LINE__)
 
 void assert_true(int real, const char* caller, int line);
-#define ASSERT_TRUE(real) assert_true(real, __FILE__, __LINE__)
+#define ASSERT_TRUE(real) ctest_impl_assert_true(real, __FILE__, __LINE__)
 
 void assert_false(int real, const char* caller, int line);
-#define ASSERT_FALSE(real) assert_false(real, __FILE__, __LINE__)
+#define ASSERT_FALSE(real) ctest_impl_assert_false(real, __FILE__, __LINE__)
 
-void assert_fail(const char* caller, int line);
-#define ASSERT_FAIL() assert_fail(__FILE__, __LINE__)
+void assert_fail(const char* caller, int line) CTEST_IMPL_NORETURN;
+#define ASSERT_FAIL() ctest_impl_fail_text("shouldn't come here", __FILE__, __LINE__)
 
 void assert_dbl_near(double exp, double real, double tol, const char* caller, int line);
-#define ASSERT_DBL_NEAR(exp, real) assert_dbl_near(exp, real, 1e-4, __FILE__, __LINE__)
-#define ASSERT_DBL_NEAR_TOL(exp, real, tol) assert_dbl_near(exp, real, tol, __FILE__, __LINE__)
+#define ASSERT_DBL_NEAR(exp, real) ctest_impl_assert_dbl_near(exp, real, 1e-4, __FILE__, __LINE__)
+#define ASSERT_DBL_NEAR_TOL(exp, real, tol) ctest_impl_assert_dbl_near(exp, real, tol, __FILE__, __LINE__)
 
 void assert_dbl_far(double exp, double real, double tol, const char* caller, int line);
-#define ASSERT_DBL_FAR(exp, real) assert_dbl_far(exp, real, 1e-4, __FILE__, __LINE__)
-#define ASSERT_DBL_FAR_TOL(exp, real, tol) assert_dbl_far(exp, real, tol, __FILE__, __LINE__)
+#define ASSERT_DBL_FAR(exp, real) ctest_impl_assert_dbl_far(exp, real, 1e-4, __FILE__, __LINE__)
+#define ASSERT_DBL_FAR_TOL(exp, real, tol) ctest_impl_assert_dbl_far(exp, real, tol, __FILE__, __LINE__)
+
+/*
+ * Latency histogram (HDR style): 2^CTEST_IMPL_HIST_BITS sub-buckets per power
+ * of two, so every bucket is within about 1.6% of its values. Values up to
+ * 2^CTEST_IMPL_HIST_MAX_BITS ns (18 minutes) have their own bucket, larger
+ * ones share the last. Start from a zeroed struct; ctest_hist_record() is
+ * inline and cheap enough for hot loops.
+ */
+#define CTEST_IMPL_HIST_BITS 6
+#define CTEST_IMPL_HIST_MAX_BITS 40
+#define CTEST_IMPL_HIST_BUCKETS ((CTEST_IMPL_HIST_MAX_BITS - CTEST_IMPL_HIST_BITS + 1) << CTEST_IMPL_HIST_BITS)
+
+struct ctest_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[CTEST_IMPL_HIST_BUCKETS];
+};
+
+static inline size_t ctest_impl_hist_index(uint64_t value) {
+    if (value < (2 << CTEST_IMPL_HIST_BITS)) return (size_t) value;
+#ifdef __GNUC__
+    const int shift = 63 - __builtin_clzll(value) - CTEST_IMPL_HIST_BITS;
+#else
+    int shift = -CTEST_IMPL_HIST_BITS;
+    while (value >> (shift + CTEST_IMPL_HIST_BITS) >> 1) shift++;
+#endif
+    const size_t index = ((size_t) shift << CTEST_IMPL_HIST_BITS) + (size_t) (value >> shift);
+    return index < CTEST_IMPL_HIST_BUCKETS ? index : CTEST_IMPL_HIST_BUCKETS - 1;
+}
+
+static inline void ctest_hist_record(struct ctest_hist* hist, uint64_t ns) {
+    hist->buckets[ctest_impl_hist_index(ns)]++;
+    hist->count++;
+    if (ns > hist->max) hist->max = ns;
+}
+
+// the value that 'percentile' % of the recorded values don't exceed (100 is the max)
+uint64_t ctest_hist_percentile(const struct ctest_hist* hist, double percentile);
+// monotonic clock in ns, to time what goes into a histogram
+uint64_t ctest_now_ns(void);
+
+void assert_latency(const struct ctest_hist* hist, double percentile, uint64_t limit_ns, const char* caller, int line);
+#define ASSERT_LATENCY(hist, percentile, limit_ns) assert_latency(hist, percentile, limit_ns, __FILE__, __LINE__)
+#define ASSERT_LATENCY_P50(hist, limit_ns) assert_latency(hist, 50, limit_ns, __FILE__, __LINE__)
+#define ASSERT_LATENCY_P90(hist, limit_ns) assert_latency(hist, 90, limit_ns, __FILE__, __LINE__)
+#define ASSERT_LATENCY_P99(hist, limit_ns) assert_latency(hist, 99, limit_ns, __FILE__, __LINE__)
+#define ASSERT_LATENCY_P999(hist, limit_ns) assert_latency(hist, 99.9, limit_ns, __FILE__, __LINE__)
+#define ASSERT_LATENCY_MAX(hist, limit_ns) assert_latency(hist, 100, limit_ns, __FILE__, __LINE__)
 
 #ifdef CTEST_MAIN
 
@@ -187,18 +442,344 @@ void assert_dbl_far(double exp, double real, double tol, const char* caller, int
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <elf.h>
+#include <linux/perf_event.h>
+#include <sys/auxv.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __GLIBC__
+#include <stdio_ext.h>
+#endif
+#ifdef CTEST_MEMORY
+#include <malloc.h>
+#ifndef __GLIBC__
+#error "CTEST_MEMORY needs glibc"
+#endif
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CTEST_IMPL_X86_SIMD
+#include <immintrin.h>
+#endif
+
+enum {
+    CTEST_IMPL_LOG_DEBUG,
+    CTEST_IMPL_LOG_INFO,
+    CTEST_IMPL_LOG_WARN,
+    CTEST_IMPL_LOG_ERR,
+};
+
+static const char* const log_names[] = { "debug", "info", "warn" };
 
-static size_t ctest_errorsize;
-static char* ctest_errormsg;
-#define MSG_SIZE 4096
-static char ctest_errorbuffer[MSG_SIZE];
-static jmp_buf ctest_err;
+/*
+ * Messages of the running test go to a buffer that grows as needed and is
+ * reset, not freed, between tests. Nothing is allocated until a test
+ * actually logs something.
+ *
+ * The failure state is per thread, so an assert on a thread started by a
+ * test doesn't longjmp across threads. ctest_jmp_ready marks the threads
+ * that have a ctest_err to jump to.
+ */
+#define CTEST_IMPL_TLS __thread
+#define CTEST_IMPL_MSG_SIZE 4096
+static char ctest_errorempty[1];
+static CTEST_IMPL_TLS char* ctest_errorbuffer = ctest_errorempty;
+static CTEST_IMPL_TLS size_t ctest_errorlen;
+static CTEST_IMPL_TLS size_t ctest_errorcap;
+static CTEST_IMPL_TLS jmp_buf ctest_err;
+static CTEST_IMPL_TLS int ctest_jmp_ready;
+static CTEST_IMPL_TLS const char* ctest_fail_file;     // location of the failed assert, if any
+static CTEST_IMPL_TLS int ctest_fail_line;
+static CTEST_IMPL_TLS unsigned int ctest_generation;  // thread_generation when this thread started
+static pthread_t ctest_main_thread;
 static int color_output = 1;
 static const char* suite_name;
+static int num_jobs = 1;
+static int fork_mode = 0;       // run tests in child processes, even with one job
+static int batch_size = 1;      // tests per child process
+static int text_output = 1;     // human readable output on stdout
+static int quiet_output = 0;    // --quiet, only failures and the summary
+static int output_format;
+static int log_level = CTEST_IMPL_LOG_INFO;    // --log-level, messages below it are dropped
+static int log_fd = -1;         // --log-file
+static uint64_t log_start;      // start of the running test, for the timestamps
+static const struct ctest* log_test;
+static FILE* format_file;       // destination of --format records
+static int shard_index = 0;
+static int shard_count = 1;
+static const char* timing_file;
+static const char* save_timing_file;
+static const char* state_file;  // --state-file, results of the last run
+static int changed_only = 0;    // --changed-only
+static int prioritize = 0;      // --prioritize
+static int max_failures = 0;    // --fail-fast, --max-failures, 0 runs everything
+static int num_run_failures;    // failed tests so far, over all rounds
+static int run_benchmarks = 0;
+static int perf_counters = 0;   // --perf
+static const char* save_baseline_file;
+static const char* compare_baseline_file;
+static double baseline_threshold = 10;  // %, change that counts as a regression
+static int baseline_runs = 5;   // runs per test to get a stddev, benchmarks use their samples
+static unsigned int default_timeout = 0;    // ms, 0 is no timeout
+
+// grace period before the parent kills a worker that doesn't stop by itself
+#define CTEST_IMPL_KILL_GRACE_MS 500
+// alternate stack of the signal handlers
+#define CTEST_IMPL_SIGNAL_STACK 65536
+
+#ifndef CTEST_BENCH_SAMPLES
+#define CTEST_BENCH_SAMPLES 10
+#endif
+#ifndef CTEST_BENCH_SAMPLE_US
+#define CTEST_BENCH_SAMPLE_US 10000
+#endif
+
+enum {
+    CTEST_RESULT_OK,
+    CTEST_RESULT_FAIL,
+    CTEST_RESULT_SKIP,
+    CTEST_RESULT_TIMEOUT,
+    CTEST_RESULT_CRASH,
+};
+
+// allocations of one test, from the start of setup to the end of teardown
+struct ctest_memstats {
+    uint64_t peak;      // most bytes in use at once
+    uint64_t allocs;
+    int64_t leaked;     // bytes still in use after teardown
+    int64_t leaked_allocs;
+};
+
+#ifdef CTEST_MEMORY
+/*
+ * Replaces malloc & co for the whole program. The counters only move while a
+ * test runs. Live sizes come from malloc_usable_size() so no header is needed,
+ * the limit of CTEST_ALLOC_LIMIT is checked against the requested sizes.
+ * Memory allocated before the test but freed by it makes the leak count go
+ * down, so leaks are a net number.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+static int mem_active;
+static int64_t mem_live;
+static int64_t mem_live_allocs;
+static uint64_t mem_peak;
+static uint64_t mem_allocs;
+static uint64_t mem_total;      // bytes requested, freed or not
+
+static void mem_add(void* ptr, size_t requested) {
+    if (ptr == NULL || !__atomic_load_n(&mem_active, __ATOMIC_RELAXED)) return;
+    const uint64_t size = (uint64_t) malloc_usable_size(ptr);
+    const int64_t live = __atomic_add_fetch(&mem_live, (int64_t) size, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+    while (live > 0 && (uint64_t) live > peak &&
+           !__atomic_compare_exchange_n(&mem_peak, &peak, (uint64_t) live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+    __atomic_add_fetch(&mem_live_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem_total, (uint64_t) requested, __ATOMIC_RELAXED);
+}
+
+static void mem_sub(void* ptr) {
+    if (ptr == NULL || !__atomic_load_n(&mem_active, __ATOMIC_RELAXED)) return;
+    __atomic_sub_fetch(&mem_live, (int64_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem_live_allocs, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    void* ptr = __libc_malloc(size);
+    mem_add(ptr, size);
+    return ptr;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    void* ptr = __libc_calloc(nmemb, size);
+    mem_add(ptr, nmemb * size);
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    mem_sub(ptr);
+    void* result = __libc_realloc(ptr, size);
+    if (result) mem_add(result, size);
+    else if (size) mem_add(ptr, 0);     // failed, the old block is still there
+    return result;
+}
+
+void free(void* ptr) {
+    mem_sub(ptr);
+    __libc_free(ptr);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    void* ptr = __libc_memalign(alignment, size);
+    mem_add(ptr, size);
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1))) return EINVAL;
+    *memptr = memalign(alignment, size);
+    return *memptr ? 0 : ENOMEM;
+}
+
+static void mem_start(void) {
+    mem_live = mem_live_allocs = 0;
+    mem_peak = mem_allocs = mem_total = 0;
+    __atomic_store_n(&mem_active, 1, __ATOMIC_SEQ_CST);
+}
+
+static void mem_stop(struct ctest_memstats* stats) {
+    __atomic_store_n(&mem_active, 0, __ATOMIC_SEQ_CST);
+    stats->peak = mem_peak;
+    stats->allocs = mem_allocs;
+    stats->leaked = mem_live;
+    stats->leaked_allocs = mem_live_allocs;
+}
+
+static uint64_t mem_allocated(void) {
+    return __atomic_load_n(&mem_total, __ATOMIC_RELAXED);
+}
+#else
+static void mem_start(void) {}
+static void mem_stop(struct ctest_memstats* stats) { memset(stats, 0, sizeof(*stats)); }
+static uint64_t mem_allocated(void) { return 0; }
+#endif
+
+// stats of the last run_test()
+static struct ctest_memstats ctest_mem;
+
+// repeated measurements of a test: ns per run, or ns/op for benchmarks
+struct ctest_samples {
+    int n;
+    double mean;
+    double stddev;
+};
+
+static struct ctest_samples ctest_samples;
+
+// hardware counters around the run() of a test, with --perf
+enum {
+    CTEST_PERF_CYCLES,
+    CTEST_PERF_INSTRUCTIONS,
+    CTEST_PERF_CACHE_MISSES,
+    CTEST_PERF_BRANCH_MISSES,
+    CTEST_PERF_COUNT,
+};
+
+struct ctest_perfstats {
+    int valid;      // bit per counter that could be read
+    uint64_t value[CTEST_PERF_COUNT];
+};
+
+static const char* const perf_names[CTEST_PERF_COUNT] = {
+    "cycles", "instructions", "cache_misses", "branch_misses",
+};
+
+#ifdef __linux__
+/*
+ * One counter per event, inherited by the threads (and processes) a test
+ * starts, so ctest_run_threads and CTEST_STRESS are counted in full. The
+ * counts of a thread are added when it exits; a reset doesn't clear those,
+ * so the counters are read before and after run(). Inherited counters can't
+ * be read as a group, each is scaled by its own running time in case the
+ * kernel had to multiplex them. A forked child opens its own counters. Counters that
+ * can't be opened (containers, VMs, perf_event_paranoid) are left out without
+ * a message.
+ */
+static int perf_fd[CTEST_PERF_COUNT] = { -1, -1, -1, -1 };
+static uint64_t perf_base[CTEST_PERF_COUNT][3];     // value, time enabled, time running
+static int perf_running;
+static pid_t perf_pid;
+
+static void perf_open(void) {
+    static const uint64_t configs[CTEST_PERF_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    struct perf_event_attr attr;
+    int i;
+    perf_pid = getpid();
+    for (i = 0; i < CTEST_PERF_COUNT; i++) {
+        if (perf_fd[i] >= 0) close(perf_fd[i]);
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf_fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static void perf_start(void) {
+    int i;
+    if (!perf_counters) return;
+    if (perf_pid != getpid()) perf_open();
+    for (i = 0; i < CTEST_PERF_COUNT; i++) {
+        if (perf_fd[i] < 0 || read(perf_fd[i], perf_base[i], sizeof(perf_base[i])) != (ssize_t) sizeof(perf_base[i])) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        perf_running = 1;
+    }
+}
+
+static void perf_stop(struct ctest_perfstats* stats) {
+    uint64_t data[3];
+    int i, j;
+    memset(stats, 0, sizeof(*stats));
+    if (!perf_running) return;     // the test failed before run()
+    perf_running = 0;
+    for (i = 0; i < CTEST_PERF_COUNT; i++) {
+        if (perf_fd[i] >= 0) ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (i = 0; i < CTEST_PERF_COUNT; i++) {
+        if (perf_fd[i] < 0 || read(perf_fd[i], data, sizeof(data)) != (ssize_t) sizeof(data)) continue;
+        for (j = 0; j < 3; j++) data[j] -= perf_base[i][j];
+        if (data[2] == 0) continue;
+        stats->value[i] = data[2] < data[1] ? (uint64_t) ((double) data[0] * (double) data[1] / (double) data[2]) : data[0];
+        stats->valid |= 1 << i;
+    }
+}
+#else
+static void perf_start(void) {}
+static void perf_stop(struct ctest_perfstats* stats) { memset(stats, 0, sizeof(*stats)); }
+#endif
+
+static struct ctest_perfstats ctest_perf;
+
+enum {
+    CTEST_FORMAT_TEXT,
+    CTEST_FORMAT_JUNIT,
+    CTEST_FORMAT_JSONL,
+};
 
 typedef int (*ctest_filter_func)(struct ctest*);
 
@@ -222,20 +803,157 @@ typedef int (*ctest_filter_func)(struct ctest*);
 
 CTEST(suite, test) { }
 
+// monotonic time in ns, not affected by NTP adjustments
+static uint64_t getCurrentTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now64 = (uint64_t) now.tv_sec;
+    now64 *= 1000000000;
+    now64 += ((uint64_t) now.tv_nsec);
+    return now64;
+}
+
+static void format_duration(char* buf, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, size, "%" PRIu64 " ns", ns);
+    else if (ns < 1000000) snprintf(buf, size, "%.1f us", (double) ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, size, "%.1f ms", (double) ns / 1e6);
+    else snprintf(buf, size, "%.2f s", (double) ns / 1e9);
+}
+
+static void write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*) data;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += n;
+        size -= (size_t) n;
+    }
+}
+
 static void vprint_errormsg(const char* const fmt, va_list ap) CTEST_IMPL_FORMAT_PRINTF(1, 0);
 static void print_errormsg(const char* const fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
 
+// the buffers of ctest itself must not show up in the CTEST_MEMORY statistics of a test
+#ifdef CTEST_MEMORY
+#define CTEST_IMPL_RAW_REALLOC __libc_realloc
+#define CTEST_IMPL_RAW_FREE __libc_free
+#else
+#define CTEST_IMPL_RAW_REALLOC realloc
+#define CTEST_IMPL_RAW_FREE free
+#endif
+
+/*
+ * Messages of other threads are merged into thread_log when the thread ends,
+ * the test thread picks them up after the join. A thread without a ctest_err
+ * (a plain pthread) that fails counts in thread_failures and exits.
+ *
+ * A test that times out leaves its threads running. thread_generation is
+ * bumped then, and whatever threads of an older generation report later is
+ * dropped instead of charged to the next test. A plain pthread gets its
+ * generation when it first logs something.
+ */
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static char* thread_log;
+static size_t thread_log_len;
+static size_t thread_log_cap;
+static int thread_failures;
+static int thread_start_failed;     // ctest_run_threads couldn't start all threads
+static unsigned int thread_generation;
+static const char* thread_fail_file;
+static int thread_fail_line;
+
+static int thread_current(void) {
+    return ctest_generation == __atomic_load_n(&thread_generation, __ATOMIC_SEQ_CST);
+}
+
+static void thread_fail(void) {
+    pthread_mutex_lock(&thread_lock);
+    if (thread_current()) __atomic_add_fetch(&thread_failures, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&thread_lock);
+}
+
+// moves the messages of this thread to thread_log
+static void thread_merge(void) {
+    pthread_mutex_lock(&thread_lock);
+    if (!thread_current()) {
+        // a thread of a test that timed out
+    } else if (ctest_fail_file && !thread_fail_file) {
+        thread_fail_file = ctest_fail_file;
+        thread_fail_line = ctest_fail_line;
+    }
+    if (ctest_errorlen > 0 && thread_current()) {
+        if (thread_log_len + ctest_errorlen + 1 > thread_log_cap) {
+            thread_log_cap = (thread_log_len + ctest_errorlen + 1) * 2;
+            thread_log = (char*) CTEST_IMPL_RAW_REALLOC(thread_log, thread_log_cap);
+            if (thread_log == NULL) {
+                perror("ctest: realloc");
+                exit(1);
+            }
+        }
+        memcpy(thread_log + thread_log_len, ctest_errorbuffer, ctest_errorlen + 1);
+        thread_log_len += ctest_errorlen;
+    }
+    pthread_mutex_unlock(&thread_lock);
+    if (ctest_errorcap) CTEST_IMPL_RAW_FREE(ctest_errorbuffer);
+    ctest_errorbuffer = ctest_errorempty;
+    ctest_errorlen = 0;
+    ctest_errorcap = 0;
+}
+
+// plain pthreads that logged something are merged when they exit
+static void thread_exit(void* value) {
+    (void) value;
+    thread_merge();
+}
+
+static void thread_key_create(void) {
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+// makes room for 'size' more characters and the terminating 0
+static void errorbuffer_reserve(size_t size) {
+    size_t cap = ctest_errorcap ? ctest_errorcap : CTEST_IMPL_MSG_SIZE;
+    while (cap < ctest_errorlen + size + 1) cap *= 2;
+    if (cap == ctest_errorcap) return;
+    char* buf = (char*) CTEST_IMPL_RAW_REALLOC(ctest_errorcap ? ctest_errorbuffer : NULL, cap);
+    if (buf == NULL) {
+        perror("ctest: realloc");
+        exit(1);
+    }
+    if (ctest_errorcap == 0 && !pthread_equal(pthread_self(), ctest_main_thread)) {
+        pthread_once(&thread_once, thread_key_create);
+        if (!ctest_jmp_ready) ctest_generation = __atomic_load_n(&thread_generation, __ATOMIC_SEQ_CST);
+        pthread_setspecific(thread_key, buf);
+    }
+    ctest_errorbuffer = buf;
+    ctest_errorcap = cap;
+}
+
+// drops everything after 'mark', an earlier ctest_errorlen
+static void errorbuffer_truncate(size_t mark) {
+    ctest_errorlen = mark;
+    ctest_errorbuffer[mark] = 0;
+}
+
 static void vprint_errormsg(const char* const fmt, va_list ap) {
+    va_list again;
+    va_copy(again, ap);
     // (v)snprintf returns the number that would have been written
-    const int ret = vsnprintf(ctest_errormsg, ctest_errorsize, fmt, ap);
+    int ret = vsnprintf(ctest_errorbuffer + ctest_errorlen, ctest_errorcap - ctest_errorlen, fmt, ap);
+    if (ret > 0 && (size_t) ret >= ctest_errorcap - ctest_errorlen) {
+        errorbuffer_reserve((size_t) ret);
+        ret = vsnprintf(ctest_errorbuffer + ctest_errorlen, ctest_errorcap - ctest_errorlen, fmt, again);
+    }
+    va_end(again);
     if (ret < 0) {
-        ctest_errormsg[0] = 0x00;
+        ctest_errorbuffer[ctest_errorlen] = 0;
     } else {
-        const size_t size = (size_t) ret;
-        const size_t s = (ctest_errorsize <= size ? size -ctest_errorsize : size);
-        // ctest_errorsize may overflow at this point
-        ctest_errorsize -= s;
-        ctest_errormsg += s;
+        ctest_errorlen += (size_t) ret;
     }
 }
 
@@ -260,16 +978,57 @@ static void msg_end(void) {
     print_errormsg("\n");
 }
 
-void CTEST_LOG(const char* fmt, ...)
+/*
+ * Log messages carry the time since the start of the test. With --log-file
+ * they go to the file instead of the output, errors go to both.
+ */
+static void vlog_message(int level, const char* color, const char* title, const char* fmt, va_list ap) CTEST_IMPL_FORMAT_PRINTF(4, 0);
+
+static void vlog_message(int level, const char* color, const char* title, const char* fmt, va_list ap) {
+    char time[32];
+    if (level < log_level) return;
+    format_duration(time, sizeof(time), getCurrentTime() - log_start);
+    if (log_fd >= 0) {
+        va_list again;
+        const size_t mark = ctest_errorlen;
+        va_copy(again, ap);
+        if (log_test) print_errormsg("%s:%s ", log_test->ssname, log_test->ttname);
+        print_errormsg("+%s %s: ", time, title);
+        vprint_errormsg(fmt, again);
+        va_end(again);
+        print_errormsg("\n");
+        write_all(log_fd, ctest_errorbuffer + mark, ctest_errorlen - mark);
+        errorbuffer_truncate(mark);
+        if (level != CTEST_IMPL_LOG_ERR) return;
+    }
+    msg_start(color, title);
+    if (level != CTEST_IMPL_LOG_ERR) print_errormsg("+%s  ", time);
+    vprint_errormsg(fmt, ap);
+    msg_end();
+}
+
+void CTEST_DEBUG(const char* fmt, ...)
 {
     va_list argp;
-    msg_start(ANSI_BLUE, "LOG");
+    va_start(argp, fmt);
+    vlog_message(CTEST_IMPL_LOG_DEBUG, ANSI_GREY, "DEBUG", fmt, argp);
+    va_end(argp);
+}
 
+void CTEST_LOG(const char* fmt, ...)
+{
+    va_list argp;
     va_start(argp, fmt);
-    vprint_errormsg(fmt, argp);
+    vlog_message(CTEST_IMPL_LOG_INFO, ANSI_BLUE, "LOG", fmt, argp);
     va_end(argp);
+}
 
-    msg_end();
+void CTEST_WARN(const char* fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    vlog_message(CTEST_IMPL_LOG_WARN, ANSI_MAGENTA, "WARN", fmt, argp);
+    va_end(argp);
 }
 
 CTEST_IMPL_DIAG_PUSH_IGNORED(missing-noreturn)
@@ -277,255 +1036,3553 @@ CTEST_IMPL_DIAG_PUSH_IGNORED(missing-noreturn)
 void CTEST_ERR(const char* fmt, ...)
 {
     va_list argp;
-    msg_start(ANSI_YELLOW, "ERR");
-
     va_start(argp, fmt);
-    vprint_errormsg(fmt, argp);
+    vlog_message(CTEST_IMPL_LOG_ERR, ANSI_YELLOW, "ERR", fmt, argp);
     va_end(argp);
-
-    msg_end();
+    if (!ctest_jmp_ready) {
+        // a thread the test started itself, nowhere to jump to
+        thread_fail();
+        thread_merge();
+        pthread_exit(NULL);
+    }
     longjmp(ctest_err, 1);
 }
 
 CTEST_IMPL_DIAG_POP()
 
+static void fail_at(const char* caller, int line) {
+    ctest_fail_file = caller;
+    ctest_fail_line = line;
+}
+
 void assert_str(const char* exp, const char*  real, const char* caller, int line) {
     if ((exp == NULL && real != NULL) ||
         (exp != NULL && real == NULL) ||
         (exp && real && strcmp(exp, real) != 0)) {
+        fail_at(caller, line);
         CTEST_ERR("%s:%d  expected '%s', got '%s'", caller, line, exp, real);
     }
 }
 
-void assert_data(const unsigned char* exp, size_t expsize,
-                 const unsigned char* real, size_t realsize,
-                 const char* caller, int line) {
-    size_t i;
-    if (expsize != realsize) {
-        CTEST_ERR("%s:%d  expected %" PRIuMAX " bytes, got %" PRIuMAX, caller, line, (uintmax_t) expsize, (uintmax_t) realsize);
+/*
+ * assert_data: find the first differing byte with SSE2 or AVX2 (picked at
+ * runtime) or a word-at-a-time scalar loop. Each returns the offset of the
+ * first difference, or n if the buffers are equal.
+ */
+typedef size_t (*ctest_mismatch_func)(const unsigned char* a, const unsigned char* b, size_t n);
+
+static size_t mismatch_scalar(const unsigned char* a, const unsigned char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) break;
     }
-    for (i=0; i<expsize; i++) {
-        if (exp[i] != real[i]) {
-            CTEST_ERR("%s:%d expected 0x%02x at offset %" PRIuMAX " got 0x%02x",
-                caller, line, exp[i], (uintmax_t) i, real[i]);
-        }
+    for (; i < n; i++) {
+        if (a[i] != b[i]) return i;
     }
+    return n;
 }
 
-void assert_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
-    if (exp != real) {
-        CTEST_ERR("%s:%d  expected %" PRIdMAX ", got %" PRIdMAX, caller, line, exp, real);
+#ifdef CTEST_IMPL_X86_SIMD
+#define CTEST_IMPL_EQ16(a, b) _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (const void*) (a)), \
+                                             _mm_loadu_si128((const __m128i*) (const void*) (b)))
+#define CTEST_IMPL_EQ32(a, b) _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (const void*) (a)), \
+                                                _mm256_loadu_si256((const __m256i*) (const void*) (b)))
+
+static size_t mismatch_sse2(const unsigned char* a, const unsigned char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m128i eq = _mm_and_si128(_mm_and_si128(CTEST_IMPL_EQ16(a + i, b + i), CTEST_IMPL_EQ16(a + i + 16, b + i + 16)),
+                                   _mm_and_si128(CTEST_IMPL_EQ16(a + i + 32, b + i + 32), CTEST_IMPL_EQ16(a + i + 48, b + i + 48)));
+        if (_mm_movemask_epi8(eq) != 0xffff) break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        const unsigned int mask = (unsigned int) _mm_movemask_epi8(CTEST_IMPL_EQ16(a + i, b + i));
+        if (mask != 0xffff) return i + (size_t) __builtin_ctz(~mask);
     }
+    return i + mismatch_scalar(a + i, b + i, n - i);
 }
 
-void assert_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
-    if (exp != real) {
-        CTEST_ERR("%s:%d  expected %" PRIuMAX ", got %" PRIuMAX, caller, line, exp, real);
+__attribute__ ((target("avx2")))
+static size_t mismatch_avx2(const unsigned char* a, const unsigned char* b, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i eq = _mm256_and_si256(CTEST_IMPL_EQ32(a + i, b + i), CTEST_IMPL_EQ32(a + i + 32, b + i + 32));
+        if ((unsigned int) _mm256_movemask_epi8(eq) != 0xffffffffu) break;
+    }
+    for (; i + 32 <= n; i += 32) {
+        const unsigned int mask = (unsigned int) _mm256_movemask_epi8(CTEST_IMPL_EQ32(a + i, b + i));
+        if (mask != 0xffffffffu) return i + (size_t) __builtin_ctz(~mask);
     }
+    return i + mismatch_scalar(a + i, b + i, n - i);
 }
+#endif
 
-void assert_not_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
-    if ((exp) == (real)) {
-        CTEST_ERR("%s:%d  should not be %" PRIdMAX, caller, line, real);
-    }
+#ifdef CTEST_IMPL_X86_SIMD
+static ctest_mismatch_func mismatch_impl = mismatch_sse2;
+#else
+static ctest_mismatch_func mismatch_impl = mismatch_scalar;
+#endif
+
+// called once from ctest_main, before any test (or thread of one) runs
+static void mismatch_init(void) {
+#ifdef CTEST_IMPL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) mismatch_impl = mismatch_avx2;
+#endif
 }
 
-void assert_not_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
-    if ((exp) == (real)) {
-        CTEST_ERR("%s:%d  should not be %" PRIuMAX, caller, line, real);
-    }
+static size_t find_mismatch(const unsigned char* a, const unsigned char* b, size_t n) {
+    return mismatch_impl(a, b, n);
 }
 
-void assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
-    if (real < exp1 || real > exp2) {
-        CTEST_ERR("%s:%d  expected %" PRIdMAX "-%" PRIdMAX ", got %" PRIdMAX, caller, line, exp1, exp2, real);
+// only used once a test fails, so it's fine to go through find_mismatch
+static size_t count_mismatches(const unsigned char* a, const unsigned char* b, size_t n, size_t first) {
+    size_t count = 0;
+    size_t i = first;
+    while (i < n) {
+        count++;
+        i++;
+        i += find_mismatch(a + i, b + i, n - i);
     }
+    return count;
 }
 
-void assert_dbl_near(double exp, double real, double tol, const char* caller, int line) {
-    double diff = exp - real;
-    double absdiff = diff;
-    /* avoid using fabs and linking with a math lib */
-    if(diff < 0) {
-      absdiff *= -1;
-    }
-    if (absdiff > tol) {
-        CTEST_ERR("%s:%d  expected %0.3e, got %0.3e (diff %0.3e, tol %0.3e)", caller, line, exp, real, diff, tol);
+// hexdump of expected vs actual, two rows of 16 bytes around the offset
+static void format_data_window(char* buf, size_t size, const unsigned char* exp,
+                               const unsigned char* real, size_t n, size_t offset) {
+    size_t row = offset & ~(size_t) 15;
+    size_t first = row >= 32 ? row - 32 : 0;
+    size_t last = row + 48 < n ? row + 48 : n;
+    size_t pos = 0;
+    size_t r, i;
+#define CTEST_IMPL_APPEND(...) do { \
+        if (pos < size) { \
+            int ret_ = snprintf(buf + pos, size - pos, __VA_ARGS__); \
+            if (ret_ > 0) pos += (size_t) ret_; \
+        } \
+    } while (0)
+    for (r = first; r < last; r += 16) {
+        const size_t end = r + 16 < last ? r + 16 : last;
+        size_t marks = r;   // end of the marker line below the row
+        CTEST_IMPL_APPEND("\n    %08" PRIxMAX "  exp:", (uintmax_t) r);
+        for (i = r; i < end; i++) CTEST_IMPL_APPEND(" %02x", exp[i]);
+        CTEST_IMPL_APPEND("\n              got:");
+        for (i = r; i < end; i++) {
+            CTEST_IMPL_APPEND(" %02x", real[i]);
+            if (exp[i] != real[i]) marks = i + 1;
+        }
+        if (marks != r) {
+            CTEST_IMPL_APPEND("\n                  ");
+            for (i = r; i < marks; i++) CTEST_IMPL_APPEND("%s", exp[i] != real[i] ? " ^^" : "   ");
+        }
     }
+#undef CTEST_IMPL_APPEND
 }
 
-void assert_dbl_far(double exp, double real, double tol, const char* caller, int line) {
-    double diff = exp - real;
-    double absdiff = diff;
-    /* avoid using fabs and linking with a math lib */
-    if(diff < 0) {
-      absdiff *= -1;
+void assert_data(const unsigned char* exp, size_t expsize,
+                 const unsigned char* real, size_t realsize,
+                 const char* caller, int line) {
+    char window[2048];
+    size_t i;
+    if (expsize != realsize) {
+        fail_at(caller, line);
+        CTEST_ERR("%s:%d  expected %" PRIuMAX " bytes, got %" PRIuMAX, caller, line, (uintmax_t) expsize, (uintmax_t) realsize);
     }
-    if (absdiff <= tol) {
-        CTEST_ERR("%s:%d  expected %0.3e, got %0.3e (diff %0.3e, tol %0.3e)", caller, line, exp, real, diff, tol);
+    i = find_mismatch(exp, real, expsize);
+    if (CTEST_IMPL_UNLIKELY(i != expsize)) {
+        window[0] = 0;
+        format_data_window(window, sizeof(window), exp, real, expsize, i);
+        fail_at(caller, line);
+        CTEST_ERR("%s:%d expected 0x%02x at offset %" PRIuMAX " got 0x%02x, %" PRIuMAX " of %" PRIuMAX " bytes differ%s",
+            caller, line, exp[i], (uintmax_t) i, real[i],
+            (uintmax_t) count_mismatches(exp, real, expsize, i), (uintmax_t) expsize, window);
     }
 }
 
-void assert_null(void* real, const char* caller, int line) {
-    if ((real) != NULL) {
-        CTEST_ERR("%s:%d  should be NULL", caller, line);
-    }
+void ctest_impl_fail_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  expected %" PRIdMAX ", got %" PRIdMAX, caller, line, exp, real);
 }
 
-void assert_not_null(const void* real, const char* caller, int line) {
-    if (real == NULL) {
-        CTEST_ERR("%s:%d  should not be NULL", caller, line);
-    }
+void ctest_impl_fail_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  expected %" PRIuMAX ", got %" PRIuMAX, caller, line, exp, real);
 }
 
-void assert_true(int real, const char* caller, int line) {
-    if ((real) == 0) {
-        CTEST_ERR("%s:%d  should be true", caller, line);
+void ctest_impl_fail_not_equal(intmax_t real, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  should not be %" PRIdMAX, caller, line, real);
+}
+
+void ctest_impl_fail_not_equal_u(uintmax_t real, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  should not be %" PRIuMAX, caller, line, real);
+}
+
+void ctest_impl_fail_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  expected %" PRIdMAX "-%" PRIdMAX ", got %" PRIdMAX, caller, line, exp1, exp2, real);
+}
+
+void ctest_impl_fail_dbl(double exp, double real, double tol, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  expected %0.3e, got %0.3e (diff %0.3e, tol %0.3e)", caller, line, exp, real, exp - real, tol);
+}
+
+void ctest_impl_fail_text(const char* text, const char* caller, int line) {
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  %s", caller, line, text);
+}
+
+void assert_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
+    ctest_impl_assert_equal(exp, real, caller, line);
+}
+
+void assert_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    ctest_impl_assert_equal_u(exp, real, caller, line);
+}
+
+void assert_not_equal(intmax_t exp, intmax_t real, const char* caller, int line) {
+    ctest_impl_assert_not_equal(exp, real, caller, line);
+}
+
+void assert_not_equal_u(uintmax_t exp, uintmax_t real, const char* caller, int line) {
+    ctest_impl_assert_not_equal_u(exp, real, caller, line);
+}
+
+void assert_interval(intmax_t exp1, intmax_t exp2, intmax_t real, const char* caller, int line) {
+    ctest_impl_assert_interval(exp1, exp2, real, caller, line);
+}
+
+void assert_dbl_near(double exp, double real, double tol, const char* caller, int line) {
+    ctest_impl_assert_dbl_near(exp, real, tol, caller, line);
+}
+
+void assert_dbl_far(double exp, double real, double tol, const char* caller, int line) {
+    ctest_impl_assert_dbl_far(exp, real, tol, caller, line);
+}
+
+void assert_null(void* real, const char* caller, int line) {
+    ctest_impl_assert_null(real, caller, line);
+}
+
+void assert_not_null(const void* real, const char* caller, int line) {
+    ctest_impl_assert_not_null(real, caller, line);
+}
+
+void assert_true(int real, const char* caller, int line) {
+    ctest_impl_assert_true(real, caller, line);
+}
+
+void assert_false(int real, const char* caller, int line) {
+    ctest_impl_assert_false(real, caller, line);
+}
+
+void assert_fail(const char* caller, int line) {
+    ctest_impl_fail_text("shouldn't come here", caller, line);
+}
+
+
+static uint64_t hash_name(const char* name) {
+    uint64_t h = 14695981039346656037ULL;    // FNV-1a
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Table of all registered tests, built once at startup. Tests of the same suite
+ * are grouped together (in order of the suite's first appearance), within a
+ * suite they keep their order in the section.
+ */
+static struct ctest** ctest_table;
+static int ctest_table_size;
+
+#if defined(__ELF__)
+extern struct ctest __start_ctest[] __attribute__((weak));
+extern struct ctest __stop_ctest[] __attribute__((weak));
+#endif
+
+struct ctest_table_item {
+    struct ctest* test;
+    int suite;      // index of the first test of the same suite
+    int index;
+};
+
+static int cmp_table_item(const void* a, const void* b) {
+    const struct ctest_table_item* x = (const struct ctest_table_item*) a;
+    const struct ctest_table_item* y = (const struct ctest_table_item*) b;
+    if (x->suite != y->suite) return x->suite - y->suite;
+    return x->index - y->index;
+}
+
+static void table_add(struct ctest* test, size_t* cap);
+
+// a CTEST_PARAM entry is replaced by a copy per row, named test[row]
+static void table_add_rows(struct ctest* test, size_t* cap) {
+    const size_t namesize = strlen(test->ttname) + 24;
+    char* block = (char*) malloc((sizeof(struct ctest) + namesize) * test->param_count);
+    size_t i;
+    if (block == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    struct ctest* rows = (struct ctest*) (void*) block;
+    char* names = block + sizeof(struct ctest) * test->param_count;
+    for (i = 0; i < test->param_count; i++) {
+        char* name = names + i * namesize;
+        snprintf(name, namesize, "%s[%" PRIuMAX "]", test->ttname, (uintmax_t) i);
+        rows[i] = *test;
+        rows[i].ttname = name;
+        rows[i].param = (const char*) test->param_table + i * test->param_stride;
+        table_add(&rows[i], cap);
+    }
+}
+
+enum {
+    CTEST_SUITE_PENDING,
+    CTEST_SUITE_READY,
+    CTEST_SUITE_FAILED,
+};
+
+struct ctest_suite {
+    const char* name;
+    struct ctest* setup;
+    struct ctest* teardown;
+    int remaining;      // selected tests that still have to run
+    int state;
+    char* msg;          // output of a failed setup
+};
+
+static struct ctest_suite* suites;
+static int num_suites;
+static int num_suite_failures;  // failed teardowns
+
+static struct ctest_suite* suite_find(const char* name) {
+    int i;
+    for (i = 0; i < num_suites; i++) {
+        if (strcmp(suites[i].name, name) == 0) return &suites[i];
+    }
+    return NULL;
+}
+
+static void suite_add_fixture(struct ctest* fixture) {
+    struct ctest_suite* suite = suite_find(fixture->ssname);
+    if (suite == NULL) {
+        suites = (struct ctest_suite*) realloc(suites, sizeof(struct ctest_suite) * (size_t) (num_suites + 1));
+        if (suites == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+        suite = &suites[num_suites++];
+        memset(suite, 0, sizeof(*suite));
+        suite->name = fixture->ssname;
+    }
+    if (fixture->suite_fixture == CTEST_IMPL_SUITE_SETUP) suite->setup = fixture;
+    else suite->teardown = fixture;
+}
+
+static void table_add(struct ctest* test, size_t* cap) {
+    if (test == &CTEST_IMPL_TNAME(suite, test)) return;
+    if (test->suite_fixture) {
+        suite_add_fixture(test);
+        return;
+    }
+    if (test->param_count && test->param == NULL) {
+        table_add_rows(test, cap);
+        return;
+    }
+    if ((size_t) ctest_table_size == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        ctest_table = (struct ctest**) realloc(ctest_table, sizeof(struct ctest*) * *cap);
+        if (ctest_table == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+    }
+    ctest_table[ctest_table_size++] = test;
+}
+
+static void table_init(void) {
+    size_t cap = 0;
+    int i;
+#if defined(__ELF__)
+    if (__start_ctest && __stop_ctest) {
+        /* step over the section; in case the linker padded between objects,
+         * only accept places where a magic is found */
+        const char* p = (const char*) __start_ctest;
+        const char* end = (const char*) __stop_ctest;
+        while (p + sizeof(struct ctest) <= end) {
+            struct ctest* t = (struct ctest*) (uintptr_t) p;
+            if (t->magic == CTEST_IMPL_MAGIC) {
+                table_add(t, &cap);
+                p += sizeof(struct ctest);
+            } else {
+                p += sizeof(void*);
+            }
+        }
+    } else
+#endif
+    {
+        struct ctest* ctest_begin = &CTEST_IMPL_TNAME(suite, test);
+        struct ctest* ctest_end = &CTEST_IMPL_TNAME(suite, test);
+        struct ctest* test;
+        // find begin and end of section by comparing magics
+        while (1) {
+            struct ctest* t = ctest_begin-1;
+            if (t->magic != CTEST_IMPL_MAGIC) break;
+            ctest_begin--;
+        }
+        while (1) {
+            struct ctest* t = ctest_end+1;
+            if (t->magic != CTEST_IMPL_MAGIC) break;
+            ctest_end++;
+        }
+        ctest_end++;    // end after last one
+        for (test = ctest_begin; test != ctest_end; test++) table_add(test, &cap);
+    }
+    if (ctest_table_size == 0) return;
+
+    // group suites, using a hash of suite names to their first test
+    size_t mask = 1;
+    while (mask < (size_t) ctest_table_size * 2) mask <<= 1;
+    int* slots = (int*) malloc(sizeof(int) * mask);
+    struct ctest_table_item* items = (struct ctest_table_item*) malloc(sizeof(struct ctest_table_item) * (size_t) ctest_table_size);
+    if (slots == NULL || items == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    mask--;
+    memset(slots, 0xff, sizeof(int) * (mask + 1));
+    for (i = 0; i < ctest_table_size; i++) {
+        const char* sname = ctest_table[i]->ssname;
+        size_t h = (size_t) hash_name(sname) & mask;
+        while (slots[h] >= 0 && strcmp(ctest_table[slots[h]]->ssname, sname) != 0) h = (h + 1) & mask;
+        if (slots[h] < 0) slots[h] = i;
+        items[i].test = ctest_table[i];
+        items[i].suite = slots[h];
+        items[i].index = i;
+    }
+    qsort(items, (size_t) ctest_table_size, sizeof(struct ctest_table_item), cmp_table_item);
+    for (i = 0; i < ctest_table_size; i++) ctest_table[i] = items[i].test;
+    free(slots);
+    free(items);
+}
+
+static int suite_all(struct ctest* t) {
+    (void) t; // fix unused parameter warning
+    return 1;
+}
+
+static int suite_filter(struct ctest* t) {
+    return strncmp(suite_name, t->ssname, strlen(suite_name)) == 0;
+}
+
+/*
+ * --filter/--exclude patterns, compiled once: 'suite:test' is split into a
+ * glob for each half (a pattern without ':' only matches the suite) and
+ * '@tag' matches the tags of a test. Patterns without wildcards are compared
+ * with a plain strcmp.
+ */
+struct ctest_pattern {
+    int tag;
+    const char* suite;      // NULL matches any
+    const char* test;       // NULL matches any
+    int suite_literal;
+    int test_literal;
+};
+
+static struct ctest_pattern* filters;
+static int num_filters;
+static struct ctest_pattern* excludes;
+static int num_excludes;
+
+// glob with * and ?
+static int glob_match(const char* pattern, const char* text) {
+    const char* star = NULL;
+    const char* retry = NULL;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            retry = text;
+        } else if (*pattern == '?' || *pattern == *text) {
+            pattern++;
+            text++;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == 0;
+}
+
+static int part_match(const char* pattern, int literal, const char* text) {
+    if (pattern == NULL) return 1;
+    if (!literal) return glob_match(pattern, text);
+    // the name of a CTEST_PARAM test also selects all of its rows
+    const size_t len = strlen(pattern);
+    return strncmp(pattern, text, len) == 0 && (text[len] == 0 || text[len] == '[');
+}
+
+static int tag_match(const struct ctest_pattern* p, const char* tags) {
+    char tag[128];
+    while (tags && *tags) {
+        size_t len = strcspn(tags, ", ");
+        if (len && len < sizeof(tag)) {
+            memcpy(tag, tags, len);
+            tag[len] = 0;
+            if (part_match(p->suite, p->suite_literal, tag)) return 1;
+        }
+        tags += len;
+        tags += strspn(tags, ", ");
+    }
+    return 0;
+}
+
+static int pattern_match(const struct ctest_pattern* p, const struct ctest* t) {
+    if (p->tag) return tag_match(p, t->tags);
+    return part_match(p->suite, p->suite_literal, t->ssname) &&
+        part_match(p->test, p->test_literal, t->ttname);
+}
+
+static void pattern_add(struct ctest_pattern** list, int* count, const char* text) {
+    struct ctest_pattern* p;
+    char* copy = strdup(text);
+    char* colon;
+    *list = (struct ctest_pattern*) realloc(*list, sizeof(struct ctest_pattern) * (size_t) (*count + 1));
+    if (*list == NULL || copy == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    p = &(*list)[(*count)++];
+    memset(p, 0, sizeof(*p));
+    if (copy[0] == '@') {
+        p->tag = 1;
+        p->suite = copy + 1;
+    } else {
+        colon = strchr(copy, ':');
+        if (colon) {
+            *colon = 0;
+            p->test = colon + 1;
+        }
+        p->suite = copy;
+    }
+    if (p->suite && strcmp(p->suite, "*") == 0) p->suite = NULL;
+    if (p->test && strcmp(p->test, "*") == 0) p->test = NULL;
+    p->suite_literal = p->suite && strpbrk(p->suite, "*?") == NULL;
+    p->test_literal = p->test && strpbrk(p->test, "*?") == NULL;
+}
+
+static int test_selected(ctest_filter_func filter, struct ctest* t) {
+    int i;
+    if (t->bench && !run_benchmarks) return 0;
+    if (!filter(t)) return 0;
+    if (num_filters) {
+        for (i = 0; i < num_filters; i++) {
+            if (pattern_match(&filters[i], t)) break;
+        }
+        if (i == num_filters) return 0;
+    }
+    for (i = 0; i < num_excludes; i++) {
+        if (pattern_match(&excludes[i], t)) return 0;
+    }
+    return 1;
+}
+
+static void format_bytes(char* buf, size_t size, uint64_t bytes) {
+    if (bytes < 1024) snprintf(buf, size, "%" PRIu64 " B", bytes);
+    else if (bytes < 1024 * 1024) snprintf(buf, size, "%.1f KB", (double) bytes / 1024);
+    else if (bytes < 1024 * 1024 * 1024) snprintf(buf, size, "%.1f MB", (double) bytes / (1024 * 1024));
+    else snprintf(buf, size, "%.2f GB", (double) bytes / (1024 * 1024 * 1024));
+}
+
+/*
+ * The text output is collected in one buffer and written to fd 1 in big
+ * chunks: when a test fails, when the buffer is full, when it's older than
+ * CTEST_IMPL_OUT_FLUSH_MS and at the end of the run. On a terminal the TEST
+ * line is written before the test starts. Otherwise a watchdog thread writes
+ * it once the test runs longer than CTEST_IMPL_OUT_FLUSH_MS, and whatever a
+ * test printed to stdout itself is flushed right after the buffer, so it
+ * stays behind its TEST line. The signal handlers flush the buffer too, so
+ * the name of a test that crashes the process or hangs (^C) still shows up.
+ */
+#define CTEST_IMPL_OUT_SIZE 65536
+#define CTEST_IMPL_OUT_FLUSH_MS 100
+
+#ifdef __GLIBC__
+#define CTEST_IMPL_STDOUT_PENDING() (__fpending(stdout) > 0)
+#else
+#define CTEST_IMPL_STDOUT_PENDING() 1
+#endif
+
+static char out_buf[CTEST_IMPL_OUT_SIZE];
+static size_t out_len;
+static uint64_t out_flushed;    // time of the last flush
+static unsigned int out_flushes;
+static int out_tty;             // fd 1 is a terminal
+static int out_running;         // a test runs, only the watchdog touches the buffer
+static int out_watchdog_started;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void out_writev(struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(1, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+}
+
+// writes the buffer and 'size' bytes of 'extra' in one go, safe in a signal handler
+static void out_flush_with(const char* extra, size_t size) {
+    struct iovec iov[2];
+    int count = 0;
+    if (out_len) {
+        iov[count].iov_base = out_buf;
+        iov[count++].iov_len = out_len;
+    }
+    if (size) {
+        iov[count].iov_base = (void*) (uintptr_t) extra;
+        iov[count++].iov_len = size;
+    }
+    out_writev(iov, count);
+    out_len = 0;
+    out_flushes++;
+}
+
+static void out_flush(void) {
+    out_flush_with(NULL, 0);
+    fflush(stdout);     // what the test printed itself comes after its TEST line
+    out_flushed = getCurrentTime();
+}
+
+// a test that calls exit() can race with the watchdog
+static void out_atexit(void) {
+    pthread_mutex_lock(&out_lock);
+    out_flush();
+    pthread_mutex_unlock(&out_lock);
+}
+
+// shows the TEST line of a test that runs for long, or hangs
+static void* out_watchdog(void* arg) {
+    (void) arg;
+    for (;;) {
+        struct timespec delay = { 0, CTEST_IMPL_OUT_FLUSH_MS * 1000000L };
+        nanosleep(&delay, NULL);
+        pthread_mutex_lock(&out_lock);
+        if (out_running && out_len && getCurrentTime() - out_flushed >= (uint64_t) CTEST_IMPL_OUT_FLUSH_MS * 1000000) {
+            out_flush();
+        }
+        pthread_mutex_unlock(&out_lock);
+    }
+    return NULL;
+}
+
+// called once the TEST line is buffered, right before the test runs
+static void out_test_begin(void) {
+    if (out_tty) {
+        out_flush();
+        return;
+    }
+    if (!out_watchdog_started) {
+        pthread_t thread;
+        out_watchdog_started = 1;
+        if (pthread_create(&thread, NULL, out_watchdog, NULL) == 0) pthread_detach(thread);
+    }
+    pthread_mutex_lock(&out_lock);
+    out_running = 1;
+    pthread_mutex_unlock(&out_lock);
+}
+
+static void out_test_end(void) {
+    pthread_mutex_lock(&out_lock);
+    out_running = 0;
+    pthread_mutex_unlock(&out_lock);
+    // the test printed to stdout: its TEST line has to go out first
+    if (CTEST_IMPL_STDOUT_PENDING()) out_flush();
+}
+
+static void out_tick(void) {
+    if (out_len && getCurrentTime() - out_flushed >= (uint64_t) CTEST_IMPL_OUT_FLUSH_MS * 1000000) out_flush();
+}
+
+static void out_write(const char* data, size_t size) {
+    if (size <= sizeof(out_buf) - out_len) {
+        memcpy(out_buf + out_len, data, size);
+        out_len += size;
+        return;
+    }
+    out_flush_with(data, size);
+    out_flushed = getCurrentTime();
+}
+
+static void out_print(const char* text) {
+    out_write(text, strlen(text));
+}
+
+static void out_printf(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
+
+static void out_printf(const char* fmt, ...) {
+    va_list argp;
+    va_start(argp, fmt);
+    int n = vsnprintf(out_buf + out_len, sizeof(out_buf) - out_len, fmt, argp);
+    va_end(argp);
+    if (n < 0) return;
+    if ((size_t) n < sizeof(out_buf) - out_len) {
+        out_len += (size_t) n;
+        return;
+    }
+    // didn't fit, the text is longer than the buffer itself only in odd cases
+    char* text = (char*) malloc((size_t) n + 1);
+    if (text == NULL) return;
+    va_start(argp, fmt);
+    vsnprintf(text, (size_t) n + 1, fmt, argp);
+    va_end(argp);
+    out_write(text, (size_t) n);
+    free(text);
+}
+
+static void color_text(const char* color, const char* text) {
+    if (color_output) {
+        out_print(color);
+        out_print(text);
+        out_print(ANSI_NORMAL);
+    } else {
+        out_print(text);
+    }
+}
+
+static void color_print(const char* color, const char* text) {
+    color_text(color, text);
+    out_write("\n", 1);
+}
+
+// sys_siglist is gone from recent glibc, so keep our own names
+static const char* signal_name(int signum) {
+    static char unknown[16];
+    switch (signum) {
+    case SIGHUP: return "SIGHUP";
+    case SIGINT: return "SIGINT";
+    case SIGQUIT: return "SIGQUIT";
+    case SIGILL: return "SIGILL";
+    case SIGTRAP: return "SIGTRAP";
+    case SIGABRT: return "SIGABRT";
+    case SIGBUS: return "SIGBUS";
+    case SIGFPE: return "SIGFPE";
+    case SIGKILL: return "SIGKILL";
+    case SIGUSR1: return "SIGUSR1";
+    case SIGSEGV: return "SIGSEGV";
+    case SIGUSR2: return "SIGUSR2";
+    case SIGPIPE: return "SIGPIPE";
+    case SIGALRM: return "SIGALRM";
+    case SIGTERM: return "SIGTERM";
+    case SIGXCPU: return "SIGXCPU";
+    case SIGXFSZ: return "SIGXFSZ";
+    case SIGSYS: return "SIGSYS";
+    }
+    snprintf(unknown, sizeof(unknown), "SIG%d", signum);
+    return unknown;
+}
+
+// handlers run on their own stack, a stack overflow leaves no room on the normal one
+/*
+ * The handlers of a sanitizer or of the program under test that were there
+ * before ctest's are kept; ctest's handler does its part and then passes the
+ * signal on to them. An ignored signal stays ignored.
+ */
+#define CTEST_IMPL_MAX_SIGNAL 65
+static struct sigaction signal_previous[CTEST_IMPL_MAX_SIGNAL];
+static char signal_saved[CTEST_IMPL_MAX_SIGNAL];
+
+static void set_handler(int signum, void (*handler)(int)) {
+    static int stack_ready;
+    struct sigaction action, previous;
+    if (!stack_ready) {
+        stack_t stack;
+        stack.ss_sp = malloc(CTEST_IMPL_SIGNAL_STACK);
+        stack.ss_size = CTEST_IMPL_SIGNAL_STACK;
+        stack.ss_flags = 0;
+        if (stack.ss_sp) sigaltstack(&stack, NULL);
+        stack_ready = 1;    // forked children inherit it
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signum, &action, &previous) != 0 || signum >= CTEST_IMPL_MAX_SIGNAL) return;
+    if (!signal_saved[signum]) {
+        // the first time only, a second call would find ctest's own handler
+        signal_previous[signum] = previous;
+        signal_saved[signum] = 1;
+    }
+    if (signal_previous[signum].sa_handler == SIG_IGN && !(signal_previous[signum].sa_flags & SA_SIGINFO)) {
+        sigaction(signum, &signal_previous[signum], NULL);
+    }
+}
+
+// hands the signal to whoever handled it before ctest, by default that ends the process
+static void chain_signal(int signum) {
+    if (signum < CTEST_IMPL_MAX_SIGNAL && signal_saved[signum]) {
+        sigaction(signum, &signal_previous[signum], NULL);
+    } else {
+        signal(signum, SIG_DFL);
+    }
+    raise(signum);
+}
+
+// fatal signals without CTEST_SEGFAULT, ^C: only get the output out
+static void out_sighandler(int signum) {
+    out_flush_with(NULL, 0);
+    chain_signal(signum);
+}
+
+#ifdef CTEST_SEGFAULT
+static void sighandler(int signum)
+{
+    char msg[128];
+    snprintf(msg, sizeof(msg), "[SIGNAL %d: %s]", signum, signal_name(signum));
+    color_print(ANSI_BRED, msg);
+    out_flush_with(NULL, 0);
+
+    /* "Unregister" the signal handler and send the signal back to the process
+     * so it can terminate as expected, or reach the handler it had before */
+    chain_signal(signum);
+}
+#endif
+
+static void reset_errorbuffer(void) {
+    ctest_fail_file = NULL;
+    ctest_fail_line = 0;
+    errorbuffer_truncate(0);
+}
+
+// returns the duration in ns
+static uint64_t bench_sample(struct ctest* test, size_t iterations) {
+    uint64_t t1 = getCurrentTime();
+    if (test->data)
+        test->run(test->data, iterations);
+    else
+        test->run(iterations);
+    return getCurrentTime() - t1;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/* avoid linking with a math lib */
+static double bench_sqrt(double x) {
+    double r = x;
+    int i;
+    if (x <= 0) return 0;
+    for (i = 0; i < 64; i++) r = 0.5 * (r + x / r);
+    return r;
+}
+
+/*
+ * Grows the iteration count until a single sample takes at least
+ * CTEST_BENCH_SAMPLE_US, then takes CTEST_BENCH_SAMPLES samples of that size.
+ */
+static void run_bench(struct ctest* test) {
+    double samples[CTEST_BENCH_SAMPLES];
+    double mean = 0, var = 0;
+    size_t iterations = 1;
+    int i;
+    const uint64_t target = (uint64_t) CTEST_BENCH_SAMPLE_US * 1000;
+    while (1) {
+        uint64_t ns = bench_sample(test, iterations);
+        if (ns >= target) break;
+        // aim a bit past the target, but never grow more than 100x at once
+        size_t next = ns ? (size_t) ((double) iterations * (double) target * 1.2 / (double) ns) : iterations * 100;
+        if (next > iterations * 100) next = iterations * 100;
+        if (next <= iterations) next = iterations + 1;
+        iterations = next;
+    }
+    for (i = 0; i < CTEST_BENCH_SAMPLES; i++) {
+        samples[i] = (double) bench_sample(test, iterations) / (double) iterations;
+        mean += samples[i];
+    }
+    mean /= CTEST_BENCH_SAMPLES;
+    for (i = 0; i < CTEST_BENCH_SAMPLES; i++) var += (samples[i] - mean) * (samples[i] - mean);
+    if (CTEST_BENCH_SAMPLES > 1) var /= CTEST_BENCH_SAMPLES - 1;
+    qsort(samples, CTEST_BENCH_SAMPLES, sizeof(double), cmp_double);
+
+    ctest_samples.n = CTEST_BENCH_SAMPLES;
+    ctest_samples.mean = mean;
+    ctest_samples.stddev = bench_sqrt(var);
+
+    msg_start(ANSI_CYAN, "BENCH");
+    print_errormsg("%.2f ns/op (median), p95 %.2f ns/op, stddev %.2f ns/op, %d samples x %" PRIuMAX " iterations",
+        samples[CTEST_BENCH_SAMPLES / 2], samples[(CTEST_BENCH_SAMPLES * 95 - 1) / 100],
+        bench_sqrt(var), CTEST_BENCH_SAMPLES, (uintmax_t) iterations);
+    msg_end();
+}
+
+/*
+ * Property tests. Every value a generator returns is derived from one
+ * 64-bit 'choice', the choices of an iteration are recorded. To shrink a
+ * failure, the body is re-run with modified choices (removed, zeroed or made
+ * smaller); a choice of 0 always produces the simplest value and choices past
+ * the end of the sequence read as 0. Whatever still fails is kept. The
+ * choice buffers grow as needed, by 8 bytes per generated value or element.
+ */
+#ifndef CTEST_PROPERTY_SHRINK_LIMIT
+#define CTEST_PROPERTY_SHRINK_LIMIT 10000
+#endif
+
+static uint64_t prop_rng[4];    // xoshiro256**
+static uint64_t* prop_choices;
+static uint64_t* prop_saved;        // copies for the shrinker, same capacity
+static uint64_t* prop_candidate;
+static size_t prop_cap;
+static size_t prop_len;         // choices used so far by this run
+static size_t prop_replay_len;  // >0: take choices from prop_choices instead of the rng
+static int prop_replay;
+static int prop_report;         // log the generated values
+static int prop_active;         // a CTEST_PROPERTY body is running, the rng is seeded
+static jmp_buf prop_outer;      // ctest_err of run_test
+
+static uint64_t prop_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t prop_next(void) {
+    const uint64_t result = prop_rotl(prop_rng[1] * 5, 7) * 9;
+    const uint64_t t = prop_rng[1] << 17;
+    prop_rng[2] ^= prop_rng[0];
+    prop_rng[3] ^= prop_rng[1];
+    prop_rng[1] ^= prop_rng[2];
+    prop_rng[0] ^= prop_rng[3];
+    prop_rng[2] ^= t;
+    prop_rng[3] = prop_rotl(prop_rng[3], 45);
+    return result;
+}
+
+static void prop_seed(uint64_t seed) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        // splitmix64, so similar seeds give unrelated states
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        prop_rng[i] = z ^ (z >> 31);
+    }
+}
+
+// not counted by CTEST_MEMORY, a large input would count against the test
+static void prop_grow(void) {
+    const size_t cap = prop_cap ? prop_cap * 2 : 1024;
+    prop_choices = (uint64_t*) CTEST_IMPL_RAW_REALLOC(prop_choices, sizeof(uint64_t) * cap);
+    prop_saved = (uint64_t*) CTEST_IMPL_RAW_REALLOC(prop_saved, sizeof(uint64_t) * cap);
+    prop_candidate = (uint64_t*) CTEST_IMPL_RAW_REALLOC(prop_candidate, sizeof(uint64_t) * cap);
+    if (prop_choices == NULL || prop_saved == NULL || prop_candidate == NULL) {
+        perror("ctest: realloc");
+        exit(1);
+    }
+    prop_cap = cap;
+}
+
+// records 'c' as the next choice, or returns the next one being replayed
+static uint64_t prop_record(uint64_t c) {
+    if (prop_len == prop_cap) prop_grow();
+    if (prop_replay) c = prop_len < prop_replay_len ? prop_choices[prop_len] : 0;
+    prop_choices[prop_len++] = c;
+    return c;
+}
+
+// outside of a property the rng is all zero and nothing records the choices
+static void prop_check(void) {
+    if (!prop_active) CTEST_ERR("generator used outside CTEST_PROPERTY");
+}
+
+static uint64_t prop_choice(void) {
+    prop_check();
+    if (prop_replay) return prop_record(0);
+    // mostly uniform, but small values (edge cases) come up often
+    uint64_t c = prop_next();
+    if ((c & 7) == 0) c = prop_next() & 15;
+    return prop_record(c);
+}
+
+/*
+ * Sequences use a choice per element, 0 ends the sequence. Removing choices
+ * then makes the sequence shorter. The length is picked up front, but isn't
+ * a choice itself.
+ */
+static size_t prop_sequence_length(size_t max) {
+    prop_check();
+    return prop_replay ? 0 : (size_t) (prop_next() % ((uint64_t) max + 1));
+}
+
+static uint64_t prop_element(size_t i, size_t length) {
+    return prop_record(i < length ? prop_next() | 1 : 0);
+}
+
+static void prop_log(const char* fmt, ...) CTEST_IMPL_FORMAT_PRINTF(1, 2);
+
+// shows a generated value in the report of a failure
+static void prop_log(const char* fmt, ...) {
+    va_list argp;
+    msg_start(ANSI_BLUE, "ARG");
+    va_start(argp, fmt);
+    vprint_errormsg(fmt, argp);
+    va_end(argp);
+    msg_end();
+}
+
+int64_t ctest_gen_int(int64_t min, int64_t max) {
+    const uint64_t range = (uint64_t) max - (uint64_t) min;
+    const uint64_t c = prop_choice();
+    const uint64_t n = range == UINT64_MAX ? c : c % (range + 1);
+    int64_t value;
+    if (min <= 0 && max >= 0) {
+        // 0, -1, 1, -2, 2, ... so shrinking moves towards 0
+        const int64_t v = (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+        value = (v >= min && v <= max) ? v : (int64_t) ((uint64_t) min + n);
+    } else {
+        value = (int64_t) ((uint64_t) min + n);
+    }
+    if (prop_report) prop_log("int %" PRId64, value);
+    return value;
+}
+
+double ctest_gen_double(double min, double max) {
+    const double fraction = (double) (prop_choice() >> 11) * (1.0 / 9007199254740992.0);
+    const double value = min + fraction * (max - min);
+    if (prop_report) prop_log("double %.17g", value);
+    return value;
+}
+
+size_t ctest_gen_bytes(void* buf, size_t max_size) {
+    unsigned char* p = (unsigned char*) buf;
+    const size_t length = prop_sequence_length(max_size);
+    size_t size, i;
+    for (size = 0; size < max_size; size++) {
+        const uint64_t c = prop_element(size, length);
+        if (c == 0) break;
+        p[size] = (unsigned char) (c - 1);
+    }
+    if (prop_report) {
+        msg_start(ANSI_BLUE, "ARG");
+        print_errormsg("bytes[%" PRIuMAX "]", (uintmax_t) size);
+        for (i = 0; i < size && i < 64; i++) print_errormsg(" %02x", p[i]);
+        if (size > 64) print_errormsg(" ...");
+        msg_end();
+    }
+    return size;
+}
+
+size_t ctest_gen_string(char* buf, size_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~";
+    size_t len;
+    if (size == 0) return 0;
+    const size_t length = prop_sequence_length(size - 1);
+    for (len = 0; len < size - 1; len++) {
+        const uint64_t c = prop_element(len, length);
+        if (c == 0) break;
+        buf[len] = alphabet[(c - 1) % (sizeof(alphabet) - 1)];
+    }
+    buf[len] = 0;
+    if (prop_report) prop_log("string \"%s\"", buf);
+    return len;
+}
+
+// runs the body once, returns 1 if it failed
+static int prop_attempt(struct ctest* test, size_t msg_mark) {
+    errorbuffer_truncate(msg_mark);
+    ctest_fail_file = NULL;
+    ctest_fail_line = 0;
+    prop_len = 0;
+    switch (setjmp(ctest_err)) {
+    case 0:
+        break;
+    case 2:
+        // the timeout is handled by run_test
+        memcpy(ctest_err, prop_outer, sizeof(jmp_buf));
+        longjmp(ctest_err, 2);
+    default:
+        return 1;
+    }
+    if (test->data)
+        test->run(test->data);
+    else
+        test->run();
+    return 0;
+}
+
+// replays 'choices', keeping them if the body still fails
+// the buffers can grow during the attempt, so 'choices' is only read before it
+static int prop_try(struct ctest* test, const uint64_t* choices, size_t len, size_t msg_mark, size_t* best_len) {
+    memcpy(prop_saved, prop_choices, sizeof(uint64_t) * *best_len);
+    if (choices != prop_choices) memcpy(prop_choices, choices, sizeof(uint64_t) * len);
+    prop_replay_len = len;
+    if (prop_attempt(test, msg_mark)) {
+        *best_len = prop_len < len ? prop_len : len;   // drop what wasn't used
+        return 1;
+    }
+    memcpy(prop_choices, prop_saved, sizeof(uint64_t) * *best_len);
+    return 0;
+}
+
+static void prop_shrink(struct ctest* test, size_t msg_mark, size_t* len, unsigned int* steps) {
+    unsigned int attempts = 0;
+    int improved = 1;
+    size_t k, i;
+    prop_replay = 1;
+    while (improved && attempts < CTEST_PROPERTY_SHRINK_LIMIT) {
+        improved = 0;
+        // remove chunks of choices
+        for (k = 8; k > 0; k /= 2) {
+            for (i = 0; i + k <= *len && attempts < CTEST_PROPERTY_SHRINK_LIMIT; ) {
+                memcpy(prop_candidate, prop_choices, sizeof(uint64_t) * i);
+                memcpy(prop_candidate + i, prop_choices + i + k, sizeof(uint64_t) * (*len - i - k));
+                attempts++;
+                if (prop_try(test, prop_candidate, *len - k, msg_mark, len)) {
+                    improved = 1;
+                    (*steps)++;
+                } else {
+                    i++;
+                }
+            }
+        }
+        // make every choice as small as possible
+        for (i = 0; i < *len && attempts < CTEST_PROPERTY_SHRINK_LIMIT; i++) {
+            uint64_t lo = 0, hi = prop_choices[i];
+            while (lo < hi && attempts < CTEST_PROPERTY_SHRINK_LIMIT) {
+                const uint64_t mid = lo + (hi - lo) / 2;
+                memcpy(prop_candidate, prop_choices, sizeof(uint64_t) * *len);
+                prop_candidate[i] = mid;
+                attempts++;
+                if (prop_try(test, prop_candidate, *len, msg_mark, len)) {
+                    hi = mid;
+                    improved = 1;
+                    (*steps)++;
+                    if (i >= *len) break;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+        }
+    }
+}
+
+static uint64_t property_seed;
+static int property_seed_set;   // --seed
+
+/*
+ * Runs the body test->iterations times with fresh values. A failure is
+ * shrunk, then replayed once more with the generated values logged.
+ */
+static void run_property(struct ctest* test) {
+    char name[256];
+    size_t msg_mark = ctest_errorlen;
+    unsigned int i, steps = 0;
+    size_t len;
+    snprintf(name, sizeof(name), "%s:%s", test->ssname, test->ttname);
+    prop_seed(property_seed ^ hash_name(name));
+    memcpy(prop_outer, ctest_err, sizeof(jmp_buf));
+    prop_replay = 0;
+    prop_report = 0;
+    prop_active = 1;
+    for (i = 0; i < test->iterations; i++) {
+        if (prop_attempt(test, msg_mark)) break;
+    }
+    if (i == test->iterations) {
+        memcpy(ctest_err, prop_outer, sizeof(jmp_buf));
+        errorbuffer_truncate(msg_mark);
+        prop_active = 0;
+        return;
+    }
+    len = prop_len;
+    prop_shrink(test, msg_mark, &len, &steps);
+
+    // the final run leaves the values and the failure in the error buffer
+    prop_replay_len = len;
+    prop_report = 1;
+    errorbuffer_truncate(msg_mark);
+    msg_start(ANSI_YELLOW, "PROPERTY");
+    print_errormsg("failed after %u iterations, shrunk in %u steps, replay with --seed=%" PRIu64, i + 1, steps, property_seed);
+    msg_end();
+    const int failed = prop_attempt(test, ctest_errorlen);
+    prop_report = 0;
+    prop_active = 0;
+    memcpy(ctest_err, prop_outer, sizeof(jmp_buf));
+    if (!failed) CTEST_ERR("the shrunk counterexample passed, the property is flaky");
+    longjmp(ctest_err, 1);
+}
+
+static unsigned int test_timeout(const struct ctest* test) {
+    return test->timeout ? test->timeout : default_timeout;
+}
+
+static void set_timer(unsigned int ms) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_usec = (ms % 1000) * 1000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// a MEM line for tests that allocated, and a warning if they leaked
+static void report_memory(const struct ctest_memstats* stats) {
+    char peak[32];
+    if (stats->allocs == 0) return;
+    format_bytes(peak, sizeof(peak), stats->peak);
+    msg_start(ANSI_CYAN, "MEM");
+    print_errormsg("peak %s, %" PRIu64 " allocations", peak, stats->allocs);
+    msg_end();
+    if (stats->leaked > 0) {
+        char leaked[32];
+        format_bytes(leaked, sizeof(leaked), (uint64_t) stats->leaked);
+        msg_start(ANSI_BYELLOW, "LEAK");
+        print_errormsg("%s in %" PRId64 " allocations not freed", leaked, stats->leaked_allocs);
+        msg_end();
+    }
+}
+
+static void format_count(char* buf, size_t size, uint64_t n) {
+    if (n < 10000) snprintf(buf, size, "%" PRIu64, n);
+    else if (n < 10000000) snprintf(buf, size, "%.1fK", (double) n / 1e3);
+    else if (n < 10000000000ULL) snprintf(buf, size, "%.1fM", (double) n / 1e6);
+    else snprintf(buf, size, "%.1fG", (double) n / 1e9);
+}
+
+// a PERF line with the counters that could be read
+static void report_perf(const struct ctest_perfstats* stats) {
+    char count[32];
+    int i;
+    if (stats->valid == 0) return;
+    msg_start(ANSI_CYAN, "PERF");
+    for (i = 0; i < CTEST_PERF_COUNT; i++) {
+        if (!(stats->valid & (1 << i))) continue;
+        format_count(count, sizeof(count), stats->value[i]);
+        print_errormsg("%s%s %s", i ? ", " : "", count, perf_names[i]);
+    }
+    const int ipc = (1 << CTEST_PERF_CYCLES) | (1 << CTEST_PERF_INSTRUCTIONS);
+    if ((stats->valid & ipc) == ipc && stats->value[CTEST_PERF_CYCLES]) {
+        print_errormsg(" (%.2f IPC)", (double) stats->value[CTEST_PERF_INSTRUCTIONS] / (double) stats->value[CTEST_PERF_CYCLES]);
+    }
+    msg_end();
+}
+
+static int timeout_warned;
+
+// jumps out of a test that ran past its timeout
+static void timeout_handler(int signum) {
+    if (!pthread_equal(pthread_self(), ctest_main_thread)) {
+        // the timer signal can land on any thread, only the test thread may jump
+        pthread_kill(ctest_main_thread, signum);
+        return;
+    }
+    longjmp(ctest_err, 2);
+}
+
+/*
+ * Adds the messages of other threads to the output of the test, returns how
+ * many of them failed since the last call.
+ */
+static int thread_collect(void) {
+    pthread_mutex_lock(&thread_lock);
+    if (thread_log_len > 0) {
+        print_errormsg("%s", thread_log);
+        thread_log_len = 0;
+    }
+    if (thread_fail_file && !ctest_fail_file) {
+        ctest_fail_file = thread_fail_file;
+        ctest_fail_line = thread_fail_line;
+    }
+    thread_fail_file = NULL;
+    pthread_mutex_unlock(&thread_lock);
+    return __atomic_exchange_n(&thread_failures, 0, __ATOMIC_SEQ_CST);
+}
+
+struct ctest_threads;
+
+struct ctest_thread {
+    pthread_t thread;
+    int index;
+    struct ctest_threads* group;
+};
+
+// the threads of one ctest_run_threads call
+struct ctest_threads {
+    ctest_thread_func fn;
+    void* arg;
+    unsigned int generation;
+    int refs;       // ctest_run_threads and every running thread, the last one frees the group
+    int started;
+    int joining;    // threads before it are joined
+    struct ctest_thread* threads;
+};
+
+// of the test thread, still set when a timeout jumped out of the join
+static struct ctest_threads* threads_running;
+
+static void threads_release(struct ctest_threads* group) {
+    if (__atomic_sub_fetch(&group->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    CTEST_IMPL_RAW_FREE(group->threads);
+    CTEST_IMPL_RAW_FREE(group);
+}
+
+/*
+ * The test timed out: its threads are left running, detached, and what they
+ * report from now on is dropped. The thread that was being joined can't be
+ * detached safely, it stays a zombie.
+ */
+static void threads_abandon(void) {
+    struct ctest_threads* group = threads_running;
+    int i;
+    pthread_mutex_lock(&thread_lock);
+    __atomic_add_fetch(&thread_generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&thread_failures, 0, __ATOMIC_SEQ_CST);
+    thread_log_len = 0;
+    thread_fail_file = NULL;
+    pthread_mutex_unlock(&thread_lock);
+    if (group == NULL) return;
+    threads_running = NULL;
+    for (i = group->joining + 1; i < group->started; i++) pthread_detach(group->threads[i].thread);
+    threads_release(group);
+}
+
+static void* thread_main(void* data) {
+    struct ctest_thread* t = (struct ctest_thread*) data;
+    struct ctest_threads* group = t->group;
+    ctest_generation = group->generation;
+    ctest_jmp_ready = 1;
+    if (setjmp(ctest_err) == 0) {
+        group->fn(t->index, group->arg);
+    } else {
+        thread_fail();
+    }
+    thread_merge();
+    threads_release(group);
+    return NULL;
+}
+
+void ctest_run_threads(int count, ctest_thread_func fn, void* arg) {
+    struct ctest_threads* group = (struct ctest_threads*) CTEST_IMPL_RAW_REALLOC(NULL, sizeof(struct ctest_threads));
+    struct ctest_thread* threads = (struct ctest_thread*) CTEST_IMPL_RAW_REALLOC(NULL, sizeof(struct ctest_thread) * (size_t) (count + 1));
+    int started, err = 0;
+    if (group == NULL || threads == NULL) {
+        CTEST_IMPL_RAW_FREE(group);
+        CTEST_IMPL_RAW_FREE(threads);
+        CTEST_ERR("out of memory for %d threads", count);
+    }
+    group->fn = fn;
+    group->arg = arg;
+    group->generation = __atomic_load_n(&thread_generation, __ATOMIC_SEQ_CST);
+    group->refs = 1;
+    group->joining = 0;
+    group->threads = threads;
+    for (started = 0; started < count; started++) {
+        threads[started].index = started;
+        threads[started].group = group;
+        __atomic_add_fetch(&group->refs, 1, __ATOMIC_ACQ_REL);
+        err = pthread_create(&threads[started].thread, NULL, thread_main, &threads[started]);
+        if (err) {
+            __atomic_sub_fetch(&group->refs, 1, __ATOMIC_ACQ_REL);
+            break;
+        }
+    }
+    group->started = started;
+    __atomic_store_n(&thread_start_failed, err != 0, __ATOMIC_SEQ_CST);
+    // only the test thread can time out, threads started by other threads are simply joined
+    const int is_main = pthread_equal(pthread_self(), ctest_main_thread);
+    if (is_main) threads_running = group;
+    for (; group->joining < started; group->joining++) pthread_join(threads[group->joining].thread, NULL);
+    if (is_main) threads_running = NULL;
+    threads_release(group);
+    const int failed = thread_collect();
+    if (err) CTEST_ERR("could not start thread %d of %d: %s", started + 1, count, strerror(err));
+    if (failed) CTEST_ERR("%d of %d threads failed", failed, count);
+}
+
+// the largest value that ends up in bucket 'index'
+static uint64_t hist_value(size_t index) {
+    if (index < (2 << CTEST_IMPL_HIST_BITS)) return index;
+    const int shift = (int) (index >> CTEST_IMPL_HIST_BITS) - 1;
+    const uint64_t top = (index & ((1 << CTEST_IMPL_HIST_BITS) - 1)) + (1 << CTEST_IMPL_HIST_BITS);
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_merge(struct ctest_hist* dst, const struct ctest_hist* src) {
+    size_t i;
+    for (i = 0; i < CTEST_IMPL_HIST_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t ctest_hist_percentile(const struct ctest_hist* hist, double percentile) {
+    uint64_t target = (uint64_t) ((double) hist->count * percentile / 100.0 + 0.999999);
+    uint64_t seen = 0;
+    size_t i;
+    if (target == 0) target = 1;
+    for (i = 0; i < CTEST_IMPL_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) break;
+    }
+    if (i == CTEST_IMPL_HIST_BUCKETS) return hist->max;
+    const uint64_t value = hist_value(i);
+    return value < hist->max ? value : hist->max;
+}
+
+uint64_t ctest_now_ns(void) {
+    return getCurrentTime();
+}
+
+static const double hist_percentiles[] = { 50, 90, 99, 99.9 };
+
+// "p50 120 ns, p90 ..., max ..."
+static void format_percentiles(char* buf, size_t size, const struct ctest_hist* hist) {
+    char value[32];
+    size_t len = 0;
+    int i;
+    buf[0] = 0;
+    for (i = 0; i < (int) (sizeof(hist_percentiles) / sizeof(hist_percentiles[0])) && len < size; i++) {
+        format_duration(value, sizeof(value), ctest_hist_percentile(hist, hist_percentiles[i]));
+        len += (size_t) snprintf(buf + len, size - len, "p%g %s, ", hist_percentiles[i], value);
+    }
+    format_duration(value, sizeof(value), hist->max);
+    if (len < size) snprintf(buf + len, size - len, "max %s", value);
+}
+
+void assert_latency(const struct ctest_hist* hist, double percentile, uint64_t limit_ns, const char* caller, int line) {
+    const uint64_t actual = ctest_hist_percentile(hist, percentile);
+    char name[16], value[32], limit[32], table[512];
+    size_t len;
+    int i;
+    if (actual <= limit_ns) return;
+    if (percentile >= 100) snprintf(name, sizeof(name), "max");
+    else snprintf(name, sizeof(name), "p%g", percentile);
+    format_duration(value, sizeof(value), actual);
+    format_duration(limit, sizeof(limit), limit_ns);
+    // the whole distribution, one percentile per line
+    len = (size_t) snprintf(table, sizeof(table), "\n    %-8s %10" PRIu64, "samples", hist->count);
+    for (i = 0; i <= (int) (sizeof(hist_percentiles) / sizeof(hist_percentiles[0])) && len < sizeof(table); i++) {
+        const int last = i == (int) (sizeof(hist_percentiles) / sizeof(hist_percentiles[0]));
+        char label[16];
+        if (last) snprintf(label, sizeof(label), "max");
+        else snprintf(label, sizeof(label), "p%g", hist_percentiles[i]);
+        format_duration(value, sizeof(value), last ? hist->max : ctest_hist_percentile(hist, hist_percentiles[i]));
+        len += (size_t) snprintf(table + len, sizeof(table) - len, "\n    %-8s %10s", label, value);
+    }
+    format_duration(value, sizeof(value), actual);
+    fail_at(caller, line);
+    CTEST_ERR("%s:%d  %s latency %s exceeds %s%s", caller, line, name, value, limit, table);
+}
+
+/*
+ * CTEST_STRESS: every thread is pinned to its own cpu (where the platform
+ * allows), waits at a spinning barrier so they all start at the same moment,
+ * then calls the body until the time or count is up. A call is timed from the
+ * end of the previous one, so there is one clock read per call.
+ */
+struct ctest_stress_thread {
+    struct ctest_hist hist;
+    uint64_t calls;
+    uint64_t elapsed;
+};
+
+static struct ctest_stress_thread* stress_threads;
+static int stress_capacity;
+static struct ctest* stress_test;
+static int stress_arrived;
+static uint64_t stress_start;
+
+static void stress_pin(int index) {
+#ifdef __linux__
+    unsigned long mask[16];
+    const size_t bits = 8 * sizeof(unsigned long);
+    size_t cpus[sizeof(mask) * 8];
+    size_t i, count = 0;
+    memset(mask, 0, sizeof(mask));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0) return;
+    for (i = 0; i < sizeof(mask) * 8; i++) {
+        if (mask[i / bits] & (1UL << (i % bits))) cpus[count++] = i;
+    }
+    if (count <= 1) return;
+    const size_t cpu = cpus[(size_t) index % count];
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / bits] = 1UL << (cpu % bits);
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+    (void) index;
+#endif
+}
+
+// returns 0 if the run was called off before it started
+static int stress_barrier(int count) {
+    if (__atomic_add_fetch(&stress_arrived, 1, __ATOMIC_SEQ_CST) == count) {
+        __atomic_store_n(&stress_start, getCurrentTime(), __ATOMIC_RELEASE);
+    }
+    while (__atomic_load_n(&stress_start, __ATOMIC_ACQUIRE) == 0) {
+        if (__atomic_load_n(&thread_start_failed, __ATOMIC_RELAXED)) return 0;
+        sched_yield();
+    }
+    return 1;
+}
+
+static void stress_thread(int index, void* arg) {
+    struct ctest* test = stress_test;
+    struct ctest_stress_thread* t = &stress_threads[index];
+    (void) arg;
+    stress_pin(index);
+    if (!stress_barrier(test->stress_threads)) return;
+    const uint64_t start = __atomic_load_n(&stress_start, __ATOMIC_ACQUIRE);
+    const uint64_t deadline = start + (uint64_t) test->stress_ms * 1000000;
+    uint64_t before = getCurrentTime();
+    while (1) {
+        if (test->data)
+            test->run(test->data, index);
+        else
+            test->run(index);
+        const uint64_t after = getCurrentTime();
+        ctest_hist_record(&t->hist, after - before);
+        t->calls++;
+        t->elapsed = after - start;
+        before = after;
+        if (test->stress_count ? t->calls >= test->stress_count : after >= deadline) break;
+        // another thread failed or the test timed out, no point in going on
+        if (__atomic_load_n(&thread_failures, __ATOMIC_RELAXED) || !thread_current()) break;
+    }
+}
+
+static void format_rate(char* buf, size_t size, uint64_t calls, uint64_t ns) {
+    char count[32];
+    format_count(count, sizeof(count), ns ? (uint64_t) ((double) calls * 1e9 / (double) ns) : 0);
+    snprintf(buf, size, "%s calls/s", count);
+}
+
+static void run_stress(struct ctest* test) {
+    const int count = test->stress_threads > 0 ? test->stress_threads : 1;
+    struct ctest_hist* total;
+    uint64_t calls = 0, elapsed = 0;
+    char rate[64], duration[32], value[32];
+    int i;
+    // kept between tests, the threads' share of it doesn't count as allocated by the test
+    if (count > stress_capacity) {
+        stress_threads = (struct ctest_stress_thread*) CTEST_IMPL_RAW_REALLOC(stress_threads, sizeof(struct ctest_stress_thread) * (size_t) (count + 1));
+        if (stress_threads == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+        stress_capacity = count;
+    }
+    memset(stress_threads, 0, sizeof(struct ctest_stress_thread) * (size_t) (count + 1));
+    stress_test = test;
+    stress_arrived = 0;
+    stress_start = 0;
+    ctest_run_threads(count, stress_thread, NULL);
+
+    // the spare entry at the end collects all threads
+    total = &stress_threads[count].hist;
+    for (i = 0; i < count; i++) {
+        hist_merge(total, &stress_threads[i].hist);
+        calls += stress_threads[i].calls;
+        if (stress_threads[i].elapsed > elapsed) elapsed = stress_threads[i].elapsed;
+    }
+    format_rate(rate, sizeof(rate), calls, elapsed);
+    format_duration(duration, sizeof(duration), elapsed);
+    format_count(value, sizeof(value), calls);
+    msg_start(ANSI_CYAN, "STRESS");
+    print_errormsg("%d threads, %s calls in %s, %s", count, value, duration, rate);
+    msg_end();
+    for (i = 0; i < count; i++) {
+        format_rate(rate, sizeof(rate), stress_threads[i].calls, stress_threads[i].elapsed);
+        format_count(value, sizeof(value), stress_threads[i].calls);
+        snprintf(duration, sizeof(duration), "THREAD %d", i);
+        msg_start(ANSI_CYAN, duration);
+        print_errormsg("%s calls, %s", value, rate);
+        msg_end();
+    }
+    char table[256];
+    format_percentiles(table, sizeof(table), total);
+    msg_start(ANSI_CYAN, "LATENCY");
+    print_errormsg("%s", table);
+    msg_end();
+}
+
+// runs setup/run/teardown of a single test, messages end up in ctest_errorbuffer
+static int run_test(struct ctest* test) {
+    switch (setjmp(ctest_err)) {
+    case 0:
+        break;
+    case 2:
+        perf_stop(&ctest_perf);
+        mem_stop(&ctest_mem);
+        thread_collect();
+        threads_abandon();
+        msg_start(ANSI_YELLOW, "ERR");
+        print_errormsg("timeout of %u ms exceeded", test_timeout(test));
+        msg_end();
+        if (num_jobs <= 1 && !fork_mode && !timeout_warned) {
+            // in a child the rest of the batch moves to a fresh process instead
+            timeout_warned = 1;
+            fprintf(stderr, "ctest: a test timed out in-process and may have left locks held, use --fork to isolate tests\n");
+        }
+        return CTEST_RESULT_TIMEOUT;
+    default:
+        set_timer(0);
+        perf_stop(&ctest_perf);
+        mem_stop(&ctest_mem);
+        thread_collect();
+        return CTEST_RESULT_FAIL;
+    }
+    // rows get their own entries, so this is a CTEST_PARAM with an empty table
+    if (test->param_table && test->param == NULL) CTEST_ERR("empty parameter table, no rows to run");
+    prop_active = 0;    // in case a property timed out
+    if (test_timeout(test)) set_timer(test_timeout(test));
+    mem_start();
+    if (test->setup && *test->setup) (*test->setup)(test->data);
+    const uint64_t allocated = mem_allocated();
+    perf_start();
+    if (test->bench)
+        run_bench(test);
+    else if (test->iterations)
+        run_property(test);
+    else if (test->stress_threads)
+        run_stress(test);
+    else if (test->param && test->data)
+        test->run(test->data, test->param);
+    else if (test->param)
+        test->run(test->param);
+    else if (test->data)
+        test->run(test->data);
+    else
+        test->run();
+    perf_stop(&ctest_perf);
+    if (test->alloc_limit && !test->bench && mem_allocated() - allocated > test->alloc_limit - 1) {
+        CTEST_ERR("allocated %" PRIu64 " bytes, the limit is %" PRIuMAX, mem_allocated() - allocated, (uintmax_t) (test->alloc_limit - 1));
+    }
+    if (test->teardown && *test->teardown) (*test->teardown)(test->data);
+    const int thread_failed = thread_collect();
+    if (thread_failed) CTEST_ERR("failed on %d other thread%s", thread_failed, thread_failed > 1 ? "s" : "");
+    mem_stop(&ctest_mem);
+    if (test_timeout(test)) set_timer(0);
+    report_memory(&ctest_mem);
+    report_perf(&ctest_perf);
+    return CTEST_RESULT_OK;
+}
+
+/*
+ * For a baseline every test runs baseline_runs times, so the comparison can
+ * tell a real slowdown from noise. The messages of the last run are kept.
+ */
+static int run_sampled(struct ctest* test, uint64_t* duration) {
+    const int runs = (save_baseline_file || compare_baseline_file) && !test->bench ? baseline_runs : 1;
+    double mean = 0, m2 = 0;
+    int status = CTEST_RESULT_OK;
+    int n;
+    for (n = 0; n < runs; n++) {
+        if (n) reset_errorbuffer();
+        log_test = test;
+        log_start = getCurrentTime();
+        status = run_test(test);
+        *duration = getCurrentTime() - log_start;
+        if (status != CTEST_RESULT_OK) return status;
+        // Welford's running mean/variance
+        const double delta = (double) *duration - mean;
+        mean += delta / (n + 1);
+        m2 += delta * ((double) *duration - mean);
+    }
+    *duration = (uint64_t) mean;
+    if (!test->bench) {
+        ctest_samples.n = runs;
+        ctest_samples.mean = mean;
+        ctest_samples.stddev = runs > 1 ? bench_sqrt(m2 / (runs - 1)) : 0;
+    }
+    return status;
+}
+
+struct ctest_result {
+    int done;
+    int status;
+    uint64_t duration;  // ns
+    const char* file;   // location of the failure, if known
+    int line;
+    int signum;         // crashes: the signal that killed the test, or 0
+    int exit_code;      // crashes: the status passed to exit()
+    struct ctest_memstats mem;
+    struct ctest_perfstats perf;
+    struct ctest_samples samples;
+    char* msg;
+};
+
+// prints the status and duration of a test, completing the TEST line
+static void print_status(const struct ctest_result* r) {
+    char duration[32];
+    switch (r->status) {
+    case CTEST_RESULT_OK:
+#ifdef CTEST_COLOR_OK
+        color_text(ANSI_BGREEN, "[OK]");
+#else
+        out_print("[OK]");
+#endif
+        break;
+    case CTEST_RESULT_FAIL:
+        color_text(ANSI_BRED, "[FAIL]");
+        break;
+    case CTEST_RESULT_SKIP:
+        color_print(ANSI_BYELLOW, "[SKIPPED]");
+        return;
+    case CTEST_RESULT_TIMEOUT:
+        color_text(ANSI_BRED, "[TIMEOUT]");
+        break;
+    case CTEST_RESULT_CRASH: {
+        char crash[64];
+        if (r->signum) snprintf(crash, sizeof(crash), "[CRASH: %s]", signal_name(r->signum));
+        else snprintf(crash, sizeof(crash), "[CRASH: exit %d]", r->exit_code);
+        color_text(ANSI_BRED, crash);
+        break;
+    }
+    }
+    format_duration(duration, sizeof(duration), r->duration);
+    out_printf(" (%s)\n", duration);
+}
+
+static const char* status_name(int status) {
+    switch (status) {
+    case CTEST_RESULT_OK: return "ok";
+    case CTEST_RESULT_FAIL: return "fail";
+    case CTEST_RESULT_SKIP: return "skip";
+    case CTEST_RESULT_TIMEOUT: return "timeout";
+    case CTEST_RESULT_CRASH: return "crash";
+    }
+    return "unknown";
+}
+
+// writes a string escaped for JSON or XML, leaving out color codes
+static void format_escaped(const char* text, int xml) {
+    const char* p;
+    for (p = text; p && *p; p++) {
+        const unsigned char c = (unsigned char) *p;
+        if (c == 0x1b && p[1] == '[') {
+            while (*p && *p != 'm') p++;
+            if (*p == 0) break;
+            continue;
+        }
+        if (xml) {
+            switch (c) {
+            case '&': fputs("&amp;", format_file); break;
+            case '<': fputs("&lt;", format_file); break;
+            case '>': fputs("&gt;", format_file); break;
+            case '"': fputs("&quot;", format_file); break;
+            default:
+                if (c >= 0x20 || c == '\n' || c == '\t') fputc(c, format_file);
+            }
+        } else {
+            switch (c) {
+            case '"': fputs("\\\"", format_file); break;
+            case '\\': fputs("\\\\", format_file); break;
+            case '\n': fputs("\\n", format_file); break;
+            case '\t': fputs("\\t", format_file); break;
+            default:
+                if (c < 0x20) fprintf(format_file, "\\u%04x", c);
+                else fputc(c, format_file);
+            }
+        }
+    }
+}
+
+/*
+ * JUnit wants the counts on the testsuite tag and the properties before the
+ * testcases, but the testcases are streamed like the JSON records. In a file,
+ * space for the tag and the properties is reserved up front and filled in by
+ * format_end, and the closing tags follow the last testcase, so the file is a
+ * complete document even if the run dies. On a pipe the properties come last.
+ */
+#define CTEST_IMPL_JUNIT_HEAD 1024
+
+static long junit_head = -1;    // offset of the reserved space, -1 if it can't be rewritten
+static int junit_tests, junit_failures, junit_errors, junit_skipped;
+static const char junit_tail[] = "</testsuite>\n</testsuites>\n";
+
+// writes the closing tags and steps back over them, the next testcase replaces them
+static void junit_close(void) {
+    fputs(junit_tail, format_file);
+    fflush(format_file);
+    fseek(format_file, -(long) (sizeof(junit_tail) - 1), SEEK_CUR);
+}
+
+static void format_begin(void) {
+    if (output_format != CTEST_FORMAT_JUNIT) return;
+    fprintf(format_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n");
+    const long pos = format_file != stdout ? ftell(format_file) : -1;
+    if (pos >= 0 && !(fcntl(fileno(format_file), F_GETFL) & O_APPEND)) {
+        junit_head = pos;
+        fprintf(format_file, "%-*s\n", CTEST_IMPL_JUNIT_HEAD - 1, "<testsuite name=\"ctest\">");
+        junit_close();
+    } else {
+        fprintf(format_file, "<testsuite name=\"ctest\">\n");
+        fflush(format_file);
+    }
+}
+
+// one record per test, written as soon as the result is known
+static void format_result(const struct ctest* test, const struct ctest_result* r, const char* msg) {
+    int i;
+    if (output_format == CTEST_FORMAT_JSONL) {
+        fprintf(format_file, "{\"type\":\"test\",\"suite\":\"");
+        format_escaped(test->ssname, 0);
+        fprintf(format_file, "\",\"test\":\"");
+        format_escaped(test->ttname, 0);
+        fprintf(format_file, "\",\"status\":\"%s\",\"duration_ns\":%" PRIu64, status_name(r->status), r->duration);
+        if (r->file) {
+            fprintf(format_file, ",\"file\":\"");
+            format_escaped(r->file, 0);
+            fprintf(format_file, "\",\"line\":%d", r->line);
+        }
+        if (r->mem.allocs) {
+            fprintf(format_file, ",\"mem_peak\":%" PRIu64 ",\"mem_allocs\":%" PRIu64 ",\"mem_leaked\":%" PRId64,
+                r->mem.peak, r->mem.allocs, r->mem.leaked > 0 ? r->mem.leaked : 0);
+        }
+        for (i = 0; i < CTEST_PERF_COUNT; i++) {
+            if (r->perf.valid & (1 << i)) fprintf(format_file, ",\"%s\":%" PRIu64, perf_names[i], r->perf.value[i]);
+        }
+        if (r->status == CTEST_RESULT_CRASH) {
+            if (r->signum) fprintf(format_file, ",\"signal\":\"%s\"", signal_name(r->signum));
+            else fprintf(format_file, ",\"exit_code\":%d", r->exit_code);
+        }
+        if (msg && *msg) {
+            fprintf(format_file, ",\"message\":\"");
+            format_escaped(msg, 0);
+            fprintf(format_file, "\"");
+        }
+        fprintf(format_file, "}\n");
+        // streamed: the records so far survive a test that crashes the run
+        fflush(format_file);
+    } else if (output_format == CTEST_FORMAT_JUNIT) {
+        fprintf(format_file, "<testcase classname=\"");
+        format_escaped(test->ssname, 1);
+        fprintf(format_file, "\" name=\"");
+        format_escaped(test->ttname, 1);
+        fprintf(format_file, "\" time=\"%.9f\"", (double) r->duration / 1e9);
+        if (r->file) {
+            fprintf(format_file, " file=\"");
+            format_escaped(r->file, 1);
+            fprintf(format_file, "\" line=\"%d\"", r->line);
+        }
+        fprintf(format_file, ">\n");
+        junit_tests++;
+        if (r->status == CTEST_RESULT_SKIP) {
+            fprintf(format_file, "<skipped/>\n");
+            junit_skipped++;
+        } else if (r->status != CTEST_RESULT_OK) {
+            // a failed assert is a failure, a timeout or crash an error
+            const char* tag = r->status == CTEST_RESULT_FAIL ? "failure" : "error";
+            if (r->status == CTEST_RESULT_FAIL) junit_failures++;
+            else junit_errors++;
+            fprintf(format_file, "<%s type=\"%s\"", tag, status_name(r->status));
+            if (r->status == CTEST_RESULT_CRASH) {
+                if (r->signum) fprintf(format_file, " message=\"%s\"", signal_name(r->signum));
+                else fprintf(format_file, " message=\"exit %d\"", r->exit_code);
+            }
+            fprintf(format_file, ">");
+            format_escaped(msg, 1);
+            fprintf(format_file, "</%s>\n", tag);
+        } else if (msg && *msg) {
+            fprintf(format_file, "<system-out>");
+            format_escaped(msg, 1);
+            fprintf(format_file, "</system-out>\n");
+        }
+        fprintf(format_file, "</testcase>\n");
+        if (junit_head >= 0) junit_close();
+        else fflush(format_file);
+    }
+}
+
+static void format_end(int total, int num_ok, int num_fail, int num_skip, int num_not_run, uint64_t duration) {
+    if (output_format == CTEST_FORMAT_JSONL) {
+        fprintf(format_file, "{\"type\":\"summary\",\"total\":%d,\"ok\":%d,\"failed\":%d,\"skipped\":%d,\"not_run\":%d,\"duration_ns\":%" PRIu64 "}\n",
+            total, num_ok, num_fail, num_skip, num_not_run, duration);
+    } else if (output_format == CTEST_FORMAT_JUNIT) {
+        char head[CTEST_IMPL_JUNIT_HEAD];
+        char properties[CTEST_IMPL_JUNIT_HEAD / 2];
+        snprintf(properties, sizeof(properties),
+            "<properties>\n"
+            "<property name=\"total\" value=\"%d\"/>\n"
+            "<property name=\"ok\" value=\"%d\"/>\n"
+            "<property name=\"failed\" value=\"%d\"/>\n"
+            "<property name=\"skipped\" value=\"%d\"/>\n"
+            "<property name=\"not_run\" value=\"%d\"/>\n"
+            "<property name=\"time\" value=\"%.9f\"/>\n"
+            "</properties>",
+            total, num_ok, num_fail, num_skip, num_not_run, (double) duration / 1e9);
+        if (junit_head < 0) {
+            fprintf(format_file, "%s\n%s", properties, junit_tail);
+        } else {
+            fputs(junit_tail, format_file);
+            snprintf(head, sizeof(head), "<testsuite name=\"ctest\" tests=\"%d\" failures=\"%d\" errors=\"%d\" skipped=\"%d\" time=\"%.9f\">\n%s",
+                junit_tests, junit_failures, junit_errors, junit_skipped, (double) duration / 1e9, properties);
+            fseek(format_file, junit_head, SEEK_SET);
+            fprintf(format_file, "%-*s\n", CTEST_IMPL_JUNIT_HEAD - 1, head);
+            fseek(format_file, 0, SEEK_END);
+        }
+    }
+    fflush(format_file);
+}
+
+static void print_test_header(int idx, int total, const struct ctest* test) {
+    if (text_output) out_printf("TEST %d/%d %s:%s ", idx, total, test->ssname, test->ttname);
+}
+
+static int result_failed(const struct ctest_result* r) {
+    return r->status != CTEST_RESULT_OK && r->status != CTEST_RESULT_SKIP;
+}
+
+// counts a finished test, returns 1 once --max-failures is reached and no more tests should start
+static int stop_after(const struct ctest_result* r) {
+    if (result_failed(r)) num_run_failures++;
+    return max_failures > 0 && num_run_failures >= max_failures;
+}
+
+static void report_result(const struct ctest* test, const struct ctest_result* r, const char* msg) {
+    if (text_output) {
+        print_status(r);
+        if (msg) out_print(msg);
+        if (result_failed(r)) out_flush();
+    }
+    if (format_file) format_result(test, r, msg);
+}
+
+// runs a suite setup or teardown, messages end up in ctest_errorbuffer
+static int run_suite_fixture(struct ctest* fixture) {
+    reset_errorbuffer();
+    log_test = fixture;
+    log_start = getCurrentTime();
+    if (setjmp(ctest_err) != 0) return CTEST_RESULT_FAIL;
+    fixture->run();
+    return CTEST_RESULT_OK;
+}
+
+// also starts a new round of --repeat: every suite is set up again
+static void suite_count(struct ctest** tests, int total) {
+    int i;
+    if (num_suites == 0) return;
+    for (i = 0; i < num_suites; i++) {
+        suites[i].remaining = 0;
+        suites[i].state = CTEST_SUITE_PENDING;
+        free(suites[i].msg);
+        suites[i].msg = NULL;
+    }
+    for (i = 0; i < total; i++) {
+        struct ctest_suite* suite = suite_find(tests[i]->ssname);
+        if (suite && !tests[i]->skip) suite->remaining++;
+    }
+}
+
+/*
+ * Sets up the suite of a test the first time one of its tests runs. Returns
+ * CTEST_RESULT_FAIL with the setup output in ctest_errorbuffer if the setup
+ * failed, now or before.
+ */
+static int suite_begin(const struct ctest* test) {
+    struct ctest_suite* suite = num_suites ? suite_find(test->ssname) : NULL;
+    if (suite == NULL) return CTEST_RESULT_OK;
+    if (suite->state == CTEST_SUITE_PENDING) {
+        suite->state = CTEST_SUITE_READY;
+        if (suite->setup && run_suite_fixture(suite->setup) != CTEST_RESULT_OK) {
+            suite->state = CTEST_SUITE_FAILED;
+            suite->msg = strdup(ctest_errorbuffer);
+        }
+        if (suite->state == CTEST_SUITE_READY) return CTEST_RESULT_OK;
+    } else if (suite->state == CTEST_SUITE_READY) {
+        return CTEST_RESULT_OK;
+    }
+    reset_errorbuffer();
+    msg_start(ANSI_YELLOW, "ERR");
+    print_errormsg("setup of suite %s failed", suite->name);
+    msg_end();
+    if (suite->msg) print_errormsg("%s", suite->msg);
+    return CTEST_RESULT_FAIL;
+}
+
+static void suite_teardown(struct ctest_suite* suite) {
+    if (suite->state != CTEST_SUITE_READY || suite->teardown == NULL) return;
+    if (run_suite_fixture(suite->teardown) == CTEST_RESULT_OK) return;
+    num_suite_failures++;
+    if (text_output) {
+        out_printf("SUITE TEARDOWN %s ", suite->name);
+        color_print(ANSI_BRED, "[FAIL]");
+        out_print(ctest_errorbuffer);
+        out_flush();
+    }
+    if (output_format == CTEST_FORMAT_JSONL) {
+        fprintf(format_file, "{\"type\":\"suite_teardown\",\"suite\":\"");
+        format_escaped(suite->name, 0);
+        fprintf(format_file, "\",\"status\":\"fail\",\"message\":\"");
+        format_escaped(ctest_errorbuffer, 0);
+        fprintf(format_file, "\"}\n");
+    }
+}
+
+// tears the suite down after its last test, a failure is reported on its own
+static void suite_end(const struct ctest* test) {
+    struct ctest_suite* suite = num_suites ? suite_find(test->ssname) : NULL;
+    if (suite == NULL || test->skip || --suite->remaining > 0) return;
+    suite_teardown(suite);
+}
+
+// the run stopped early: tears down the suites that were set up but not finished
+static void suite_stop(void) {
+    int i;
+    for (i = 0; i < num_suites; i++) {
+        if (suites[i].remaining == 0) continue;
+        suites[i].remaining = 0;
+        suite_teardown(&suites[i]);
+    }
+}
+
+/*
+ * Isolated mode (--fork, -j N): tests run in forked processes, one batch of
+ * --batch tests per child. The child sends a record + the contents of its
+ * ctest_errorbuffer back over a pipe for every test, the parent collects them
+ * and prints the results in the original order. When a child dies, the test it
+ * was running is reported as a crash and the rest of its batch is handed to a
+ * new child.
+ */
+struct ctest_record {
+    int index;
+    int status;
+    int signum;
+    uint64_t duration;
+    const char* file;   // valid in the parent too, it's the same image
+    int line;
+    struct ctest_memstats mem;
+    struct ctest_perfstats perf;
+    struct ctest_samples samples;
+    size_t msglen;
+};
+
+struct ctest_worker {
+    pid_t pid;
+    int fd;
+    int* batch;     // positions in the run list
+    int count;
+    int next;       // first test of the batch without a result
+    uint64_t start;
+    uint64_t deadline;  // 0 when the test has no timeout
+    int killed;
+    int crashed;    // the child sent a crash record
+    struct ctest_record crash;
+    char* crash_msg;
+    char* buf;
+    size_t len;
+    size_t cap;
+};
+
+// state of the child, used by the crash handlers
+static int crash_fd = -1;
+static int crash_index;
+static uint64_t crash_start;
+
+static void write_record(int fd, int index, int status, int signum, uint64_t duration) {
+    struct ctest_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.index = index;
+    rec.status = status;
+    rec.signum = signum;
+    rec.duration = duration;
+    rec.file = ctest_fail_file;
+    rec.line = ctest_fail_line;
+    rec.mem = ctest_mem;
+    rec.perf = ctest_perf;
+    rec.samples = ctest_samples;
+    rec.msglen = ctest_errorlen;
+    write_all(fd, &rec, sizeof(rec));
+    write_all(fd, ctest_errorbuffer, rec.msglen);
+}
+
+// sends whatever the crashing test logged, then dies from the same signal
+static void crash_handler(int signum) {
+    if (crash_fd >= 0) {
+        write_record(crash_fd, crash_index, CTEST_RESULT_CRASH, signum, getCurrentTime() - crash_start);
+        crash_fd = -1;
+    }
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+// a test called exit(), the normal way out of a child is _exit()
+static void crash_atexit(void) {
+    if (crash_fd >= 0) {
+        write_record(crash_fd, crash_index, CTEST_RESULT_CRASH, 0, getCurrentTime() - crash_start);
+        crash_fd = -1;
+    }
+}
+
+static void crash_install(int fd) {
+    static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    size_t i;
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) set_handler(signals[i], crash_handler);
+    crash_fd = fd;
+    atexit(crash_atexit);
+}
+
+static void worker_deadline(struct ctest_worker* w, struct ctest* test) {
+    w->start = getCurrentTime();
+    w->deadline = 0;
+    if (test_timeout(test)) {
+        w->deadline = w->start + ((uint64_t) test_timeout(test) + CTEST_IMPL_KILL_GRACE_MS) * 1000000;
+    }
+}
+
+static void worker_start(struct ctest_worker* w, struct ctest** tests) {
+    int fds[2];
+    int i;
+    if (pipe(fds) != 0) {
+        perror("ctest: pipe");
+        exit(1);
+    }
+    fflush(NULL);       // don't let the child inherit buffered output, eg of --output
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ctest: fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        out_len = 0;    // the parent prints that
+        close(fds[0]);
+        crash_install(fds[1]);
+        for (i = 0; i < w->count; i++) {
+            crash_index = w->batch[i];
+            uint64_t duration = 0;
+            reset_errorbuffer();
+            crash_start = getCurrentTime();
+            int status = run_sampled(tests[crash_index], &duration);
+            write_record(fds[1], crash_index, status, 0, duration);
+            // the test may have been stopped holding a lock, don't run more in this process
+            if (status == CTEST_RESULT_TIMEOUT) break;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    w->pid = pid;
+    w->fd = fds[0];
+    w->next = 0;
+    w->len = 0;
+    w->killed = 0;
+    w->crashed = 0;
+    worker_deadline(w, tests[w->batch[0]]);
+}
+
+// returns 0 once the child closed its end of the pipe
+static int worker_read(struct ctest_worker* w) {
+    if (w->cap - w->len < 1024) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->buf = (char*) realloc(w->buf, w->cap);
+        if (w->buf == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+    }
+    ssize_t n = read(w->fd, w->buf + w->len, w->cap - w->len);
+    if (n < 0) return errno == EINTR || errno == EAGAIN;
+    w->len += (size_t) n;
+    return n != 0;
+}
+
+// takes the complete records out of the buffer
+static void worker_parse(struct ctest_worker* w, struct ctest** tests, struct ctest_result* results) {
+    struct ctest_record rec;
+    size_t pos = 0;
+    while (w->len - pos >= sizeof(rec)) {
+        memcpy(&rec, w->buf + pos, sizeof(rec));
+        if (w->len - pos - sizeof(rec) < rec.msglen) break;
+        char* msg = (char*) malloc(rec.msglen + 1);
+        if (msg) {
+            memcpy(msg, w->buf + pos + sizeof(rec), rec.msglen);
+            msg[rec.msglen] = 0;
+        }
+        pos += sizeof(rec) + rec.msglen;
+
+        if (rec.status == CTEST_RESULT_CRASH) {
+            // the child is about to die, worker_finish reports it
+            w->crashed = 1;
+            w->crash = rec;
+            free(w->crash_msg);
+            w->crash_msg = msg;
+            continue;
+        }
+        struct ctest_result* r = &results[rec.index];
+        r->status = rec.status;
+        r->duration = rec.duration;
+        r->file = rec.file;
+        r->line = rec.line;
+        r->mem = rec.mem;
+        r->perf = rec.perf;
+        r->samples = rec.samples;
+        r->msg = msg;
+        r->done = 1;
+        w->next++;
+        if (w->next < w->count) worker_deadline(w, tests[w->batch[w->next]]);
+    }
+    memmove(w->buf, w->buf + pos, w->len - pos);
+    w->len -= pos;
+}
+
+static void worker_finish(struct ctest_worker* w, struct ctest** tests, struct ctest_result* results) {
+    int wstatus = 0;
+    close(w->fd);
+    while (waitpid(w->pid, &wstatus, 0) < 0 && errno == EINTR) {}
+    worker_parse(w, tests, results);
+    w->pid = 0;
+    const int timed_out = w->next > 0 && results[w->batch[w->next - 1]].status == CTEST_RESULT_TIMEOUT &&
+                          WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+
+    if (w->next < w->count && !timed_out) {
+        struct ctest_result* r = &results[w->batch[w->next]];
+        reset_errorbuffer();
+        if (w->killed) {
+            // the child ignored its own timer, so the parent stepped in
+            r->status = CTEST_RESULT_TIMEOUT;
+            r->duration = getCurrentTime() - w->start;
+            msg_start(ANSI_YELLOW, "ERR");
+            print_errormsg("timeout exceeded, test process killed");
+            msg_end();
+            r->msg = strdup(ctest_errorbuffer);
+        } else {
+            r->status = CTEST_RESULT_CRASH;
+            if (WIFSIGNALED(wstatus)) {
+                r->signum = WTERMSIG(wstatus);
+            } else {
+                r->exit_code = WEXITSTATUS(wstatus);
+            }
+            if (w->crashed && w->crash.index == w->batch[w->next]) {
+                r->duration = w->crash.duration;
+                r->file = w->crash.file;
+                r->line = w->crash.line;
+                r->msg = w->crash_msg;
+                w->crash_msg = NULL;
+            } else {
+                r->duration = getCurrentTime() - w->start;
+            }
+        }
+        r->done = 1;
+        w->next++;
     }
+    free(w->crash_msg);
+    w->crash_msg = NULL;
+
+    // whatever is left of the batch goes to a fresh child
+    memmove(w->batch, w->batch + w->next, sizeof(int) * (size_t) (w->count - w->next));
+    w->count -= w->next;
+    w->next = 0;
 }
 
-void assert_false(int real, const char* caller, int line) {
-    if ((real) != 0) {
-        CTEST_ERR("%s:%d  should be false", caller, line);
+static int run_parallel(struct ctest** tests, int total, struct ctest_result* results) {
+    struct ctest_worker* workers = (struct ctest_worker*) calloc((size_t) num_jobs, sizeof(struct ctest_worker));
+    struct pollfd* fds = (struct pollfd*) calloc((size_t) num_jobs, sizeof(struct pollfd));
+    int* slots = (int*) calloc((size_t) num_jobs, sizeof(int));
+    int next_start = 0;
+    int next_print = 0;
+    int end = total;    // tests that will run, tests already handed out once the run stops
+    int running = 0;
+    int i;
+    if (workers == NULL || fds == NULL || slots == NULL) {
+        perror("ctest: calloc");
+        exit(1);
+    }
+    for (i = 0; i < num_jobs; i++) {
+        workers[i].batch = (int*) malloc(sizeof(int) * (size_t) batch_size);
+        if (workers[i].batch == NULL) {
+            perror("ctest: malloc");
+            exit(1);
+        }
+    }
+
+    while (next_print < end) {
+        // hand out batches to idle workers
+        for (i = 0; i < num_jobs; i++) {
+            struct ctest_worker* w = &workers[i];
+            if (w->pid) continue;
+            while (w->count < batch_size && next_start < end) {
+                if (tests[next_start]->skip) {
+                    results[next_start].status = CTEST_RESULT_SKIP;
+                    results[next_start].done = 1;
+                } else if (suite_begin(tests[next_start]) != CTEST_RESULT_OK) {
+                    // the children inherit the state of a suite setup from here
+                    results[next_start].status = CTEST_RESULT_FAIL;
+                    results[next_start].msg = strdup(ctest_errorbuffer);
+                    results[next_start].done = 1;
+                } else {
+                    w->batch[w->count++] = next_start;
+                }
+                next_start++;
+            }
+            if (w->count == 0) continue;
+            worker_start(w, tests);
+            running++;
+        }
+
+        // print whatever is ready, in order
+        while (next_print < end && results[next_print].done) {
+            struct ctest_result* r = &results[next_print];
+            if (!quiet_output || result_failed(r)) {
+                print_test_header(next_print+1, total, tests[next_print]);
+                report_result(tests[next_print], r, r->msg);
+            } else if (format_file) {
+                format_result(tests[next_print], r, r->msg);
+            }
+            free(r->msg);
+            r->msg = NULL;
+            suite_end(tests[next_print]);
+            if (stop_after(r) && end == total) end = next_start;
+            next_print++;
+        }
+        out_tick();
+        if (running == 0) continue;
+
+        int nfds = 0;
+        int timeout = -1;
+        uint64_t now = getCurrentTime();
+        if (out_len) {
+            // wake up in time to flush the output
+            const uint64_t flush_at = out_flushed + (uint64_t) CTEST_IMPL_OUT_FLUSH_MS * 1000000;
+            timeout = now < flush_at ? (int) ((flush_at - now) / 1000000) + 1 : 1;
+        }
+        for (i = 0; i < num_jobs; i++) {
+            if (!workers[i].pid) continue;
+            if (workers[i].deadline && !workers[i].killed) {
+                if (now >= workers[i].deadline) {
+                    kill(workers[i].pid, SIGKILL);
+                    workers[i].killed = 1;
+                } else {
+                    int ms = (int) ((workers[i].deadline - now) / 1000000) + 1;
+                    if (timeout < 0 || ms < timeout) timeout = ms;
+                }
+            }
+            fds[nfds].fd = workers[i].fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            slots[nfds] = i;
+            nfds++;
+        }
+        if (poll(fds, (nfds_t) nfds, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("ctest: poll");
+            exit(1);
+        }
+        for (i = 0; i < nfds; i++) {
+            struct ctest_worker* w = &workers[slots[i]];
+            if (fds[i].revents == 0) continue;
+            if (worker_read(w)) {
+                worker_parse(w, tests, results);
+            } else {
+                worker_finish(w, tests, results);
+                running--;
+            }
+        }
     }
+
+    for (i = 0; i < num_jobs; i++) {
+        free(workers[i].batch);
+        free(workers[i].buf);
+    }
+    free(workers);
+    free(fds);
+    free(slots);
+    return end;
 }
 
-void assert_fail(const char* caller, int line) {
-    CTEST_ERR("%s:%d  shouldn't come here", caller, line);
+static int parse_jobs(const char* arg) {
+    long n = (arg && *arg) ? strtol(arg, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return (int) n;
 }
 
+static void test_fullname(const struct ctest* test, char* buf, size_t size) {
+    snprintf(buf, size, "%s:%s", test->ssname, test->ttname);
+}
 
-static int suite_all(struct ctest* t) {
-    (void) t; // fix unused parameter warning
-    return 1;
+/*
+ * Timing file: one "<duration in ns> <suite>:<test>" line per test. It's
+ * read to balance shards (--timing-file) and written after the run with the
+ * new timings merged in (--save-timing). Files of several shards can simply
+ * be concatenated, the last line wins.
+ */
+struct ctest_timing {
+    char* name;
+    uint64_t duration;
+};
+
+static struct ctest_timing* timings;
+static size_t num_timings;
+static size_t* timing_slots;    // open addressing, index+1 into timings
+static size_t timing_slot_mask;
+
+static struct ctest_timing* timing_find(const char* name) {
+    size_t i;
+    if (timing_slots == NULL) return NULL;
+    for (i = (size_t) hash_name(name) & timing_slot_mask; timing_slots[i]; i = (i + 1) & timing_slot_mask) {
+        struct ctest_timing* t = &timings[timing_slots[i] - 1];
+        if (strcmp(t->name, name) == 0) return t;
+    }
+    return NULL;
 }
 
-static int suite_filter(struct ctest* t) {
-    return strncmp(suite_name, t->ssname, strlen(suite_name)) == 0;
+static void timing_set(const char* name, uint64_t duration) {
+    size_t i;
+    struct ctest_timing* t = timing_find(name);
+    if (t) {
+        t->duration = duration;
+        return;
+    }
+    if ((num_timings + 1) * 2 > timing_slot_mask) {
+        // grow the table, rehashing everything
+        size_t cap = timing_slot_mask ? (timing_slot_mask + 1) * 2 : 1024;
+        size_t n;
+        free(timing_slots);
+        timing_slots = (size_t*) calloc(cap, sizeof(size_t));
+        timings = (struct ctest_timing*) realloc(timings, sizeof(struct ctest_timing) * cap / 2);
+        if (timing_slots == NULL || timings == NULL) {
+            perror("ctest: malloc");
+            exit(1);
+        }
+        timing_slot_mask = cap - 1;
+        for (n = 0; n < num_timings; n++) {
+            for (i = (size_t) hash_name(timings[n].name) & timing_slot_mask; timing_slots[i]; i = (i + 1) & timing_slot_mask) {}
+            timing_slots[i] = n + 1;
+        }
+    }
+    for (i = (size_t) hash_name(name) & timing_slot_mask; timing_slots[i]; i = (i + 1) & timing_slot_mask) {}
+    timings[num_timings].name = strdup(name);
+    timings[num_timings].duration = duration;
+    timing_slots[i] = ++num_timings;
 }
 
-static uint64_t getCurrentTime(void) {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    uint64_t now64 = (uint64_t) now.tv_sec;
-    now64 *= 1000000;
-    now64 += ((uint64_t) now.tv_usec);
-    return now64;
+static void timing_load(const char* filename) {
+    char line[1024];
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return;      // no timings yet
+    while (fgets(line, sizeof(line), f)) {
+        char* name;
+        uint64_t duration = strtoull(line, &name, 10);
+        if (name == line || *name != ' ') continue;
+        name++;
+        name[strcspn(name, "\r\n")] = 0;
+        if (*name) timing_set(name, duration);
+    }
+    fclose(f);
 }
 
-static void color_print(const char* color, const char* text) {
-    if (color_output)
-        printf("%s%s"ANSI_NORMAL"\n", color, text);
-    else
-        printf("%s\n", text);
+static void timing_save(const char* filename) {
+    size_t i;
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return;
+    }
+    for (i = 0; i < num_timings; i++) {
+        fprintf(f, "%" PRIu64 " %s\n", timings[i].duration, timings[i].name);
+    }
+    fclose(f);
 }
 
-#ifdef CTEST_SEGFAULT
-#include <signal.h>
-static void sighandler(int signum)
-{
-    char msg[128];
-    sprintf(msg, "[SIGNAL %d: %s]", signum, sys_siglist[signum]);
-    color_print(ANSI_BRED, msg);
-    fflush(stdout);
+struct ctest_shard_item {
+    int index;
+    uint64_t cost;
+    uint64_t hash;
+};
 
-    /* "Unregister" the signal handler and send the signal back to the process
-     * so it can terminate as expected */
-    signal(signum, SIG_DFL);
-    kill(getpid(), signum);
+static int cmp_shard_item(const void* a, const void* b) {
+    const struct ctest_shard_item* x = (const struct ctest_shard_item*) a;
+    const struct ctest_shard_item* y = (const struct ctest_shard_item*) b;
+    if (x->cost != y->cost) return (x->cost < y->cost) - (x->cost > y->cost);
+    if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+    return x->index - y->index;
+}
+
+/*
+ * Keeps only the tests of this shard, in their original order. Without
+ * timings tests are spread by a hash of their name, which doesn't move tests
+ * around when others are added. With timings the longest tests are assigned
+ * first, each to the shard with the least total time so far. Every shard
+ * computes the same assignment from the same binary and timing file.
+ */
+static int apply_shard(struct ctest** tests, int total) {
+    char name[256];
+    int i, n = 0;
+    if (num_timings == 0) {
+        for (i = 0; i < total; i++) {
+            test_fullname(tests[i], name, sizeof(name));
+            if (hash_name(name) % (uint64_t) shard_count == (uint64_t) shard_index) tests[n++] = tests[i];
+        }
+        return n;
+    }
+
+    struct ctest_shard_item* items = (struct ctest_shard_item*) malloc(sizeof(struct ctest_shard_item) * (size_t) (total + 1));
+    uint64_t* load = (uint64_t*) calloc((size_t) shard_count, sizeof(uint64_t));
+    char* mine = (char*) calloc((size_t) total + 1, 1);
+    uint64_t known = 0;
+    int num_known = 0;
+    if (items == NULL || load == NULL || mine == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    for (i = 0; i < total; i++) {
+        const struct ctest_timing* t;
+        test_fullname(tests[i], name, sizeof(name));
+        t = timing_find(name);
+        items[i].index = i;
+        items[i].hash = hash_name(name);
+        items[i].cost = t ? t->duration : 0;
+        if (t) {
+            known += t->duration;
+            num_known++;
+        }
+    }
+    // tests without a timing are assumed to take the average, skipped ones cost nothing
+    for (i = 0; i < total; i++) {
+        if (tests[i]->skip) items[i].cost = 0;
+        else if (items[i].cost == 0 && num_known) items[i].cost = known / (uint64_t) num_known;
+        if (items[i].cost == 0) items[i].cost = 1;
+    }
+    qsort(items, (size_t) total, sizeof(struct ctest_shard_item), cmp_shard_item);
+    for (i = 0; i < total; i++) {
+        int s, best = 0;
+        for (s = 1; s < shard_count; s++) {
+            if (load[s] < load[best]) best = s;
+        }
+        load[best] += items[i].cost;
+        if (best == shard_index) mine[items[i].index] = 1;
+    }
+    for (i = 0; i < total; i++) {
+        if (mine[i]) tests[n++] = tests[i];
+    }
+    free(items);
+    free(load);
+    free(mine);
+    return n;
+}
+
+static void timing_update(struct ctest** tests, const struct ctest_result* results, int total) {
+    char name[256];
+    int i;
+    for (i = 0; i < total; i++) {
+        if (results[i].status == CTEST_RESULT_SKIP) continue;
+        test_fullname(tests[i], name, sizeof(name));
+        timing_set(name, results[i].duration);
+    }
+}
+
+/*
+ * State file of --changed-only and --prioritize: one "<fingerprint>
+ * <ok|fail|skip> <duration in ns> <suite>:<test>" line per test. The
+ * fingerprint hashes the machine code of the test's run function, its
+ * fixtures and the suite fixtures, its table row and its settings. A test
+ * that passed last time is only run again when its fingerprint changed.
+ * Changes in functions the test calls are not seen.
+ */
+#define CTEST_IMPL_STATE_FILE ".ctest-state"
+// bytes hashed when a function isn't in the symbol table, eg of a stripped binary
+#define CTEST_IMPL_CODE_WINDOW 256
+
+struct ctest_state {
+    char* name;
+    uint64_t fingerprint;
+    char status[8];
+    uint64_t duration;
+    int updated;    // by this run, a failure in any round sticks
+};
+
+static struct ctest_state* states;
+static size_t num_states;
+static size_t state_cap;
+static size_t num_sorted_states;    // states added by this run are not sorted yet
+
+static int cmp_state(const void* a, const void* b) {
+    return strcmp(((const struct ctest_state*) a)->name, ((const struct ctest_state*) b)->name);
+}
+
+static struct ctest_state* state_find(const char* name) {
+    struct ctest_state key;
+    key.name = (char*) name;
+    return (struct ctest_state*) bsearch(&key, states, num_sorted_states, sizeof(struct ctest_state), cmp_state);
+}
+
+static struct ctest_state* state_add(const char* name) {
+    if (num_states == state_cap) {
+        state_cap = state_cap ? state_cap * 2 : 256;
+        states = (struct ctest_state*) realloc(states, sizeof(struct ctest_state) * state_cap);
+        if (states == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+    }
+    struct ctest_state* st = &states[num_states++];
+    memset(st, 0, sizeof(struct ctest_state));
+    st->name = strdup(name);
+    return st;
+}
+
+static void state_load(const char* filename) {
+    char line[1024];
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) return;      // first run, everything runs
+    while (fgets(line, sizeof(line), f)) {
+        char status[8];
+        uint64_t fingerprint, duration;
+        int pos = 0;
+        if (sscanf(line, "%" SCNx64 " %7s %" SCNu64 " %n", &fingerprint, status, &duration, &pos) != 3 || pos == 0) continue;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[pos] == 0) continue;
+        struct ctest_state* st = state_add(line + pos);
+        st->fingerprint = fingerprint;
+        st->duration = duration;
+        strcpy(st->status, status);
+    }
+    fclose(f);
+    qsort(states, num_states, sizeof(struct ctest_state), cmp_state);
+    num_sorted_states = num_states;
+}
+
+static void state_save(const char* filename) {
+    size_t i;
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return;
+    }
+    for (i = 0; i < num_states; i++) {
+        fprintf(f, "%016" PRIx64 " %s %" PRIu64 " %s\n", states[i].fingerprint, states[i].status, states[i].duration, states[i].name);
+    }
+    fclose(f);
+}
+
+struct ctest_symbol {
+    uintptr_t addr;
+    size_t size;
+};
+
+static struct ctest_symbol* symbols;
+static size_t num_symbols;
+static int symbols_loaded;
+
+static int cmp_symbol(const void* a, const void* b) {
+    const uintptr_t x = ((const struct ctest_symbol*) a)->addr;
+    const uintptr_t y = ((const struct ctest_symbol*) b)->addr;
+    return (x > y) - (x < y);
+}
+
+#ifdef __linux__
+#if UINTPTR_MAX > 0xffffffffu
+#define CTEST_IMPL_ELF(type) Elf64_##type
+#else
+#define CTEST_IMPL_ELF(type) Elf32_##type
+#endif
+
+// where the executable is loaded relative to its link address (PIE)
+static uintptr_t symbols_bias(void) {
+    const CTEST_IMPL_ELF(Phdr)* phdr = (const CTEST_IMPL_ELF(Phdr)*) getauxval(AT_PHDR);
+    const unsigned long phnum = getauxval(AT_PHNUM);
+    unsigned long i;
+    for (i = 0; phdr && i < phnum; i++) {
+        if (phdr[i].p_type == PT_PHDR) return (uintptr_t) phdr - (uintptr_t) phdr[i].p_vaddr;
+    }
+    return 0;
+}
+
+/*
+ * Reads the sizes of all functions from the symbol table of the executable,
+ * moved to where it's loaded. Tests linked in from shared libraries aren't
+ * found and use the fallback.
+ */
+static void symbols_load(void) {
+    struct stat st;
+    const uintptr_t bias = symbols_bias();
+    size_t i, j;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CTEST_IMPL_ELF(Ehdr))) {
+        close(fd);
+        return;
+    }
+    const size_t size = (size_t) st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    const char* image = (const char*) map;
+    const CTEST_IMPL_ELF(Ehdr)* eh = (const CTEST_IMPL_ELF(Ehdr)*) map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0 && eh->e_shoff > 0
+        && eh->e_shoff + eh->e_shnum * sizeof(CTEST_IMPL_ELF(Shdr)) <= size) {
+        const CTEST_IMPL_ELF(Shdr)* sections = (const CTEST_IMPL_ELF(Shdr)*) (const void*) (image + eh->e_shoff);
+        for (i = 0; i < eh->e_shnum; i++) {
+            if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_offset + sections[i].sh_size > size) continue;
+            const CTEST_IMPL_ELF(Sym)* syms = (const CTEST_IMPL_ELF(Sym)*) (const void*) (image + sections[i].sh_offset);
+            const size_t count = sections[i].sh_size / sizeof(CTEST_IMPL_ELF(Sym));
+            symbols = (struct ctest_symbol*) realloc(symbols, sizeof(struct ctest_symbol) * (num_symbols + count));
+            if (symbols == NULL) {
+                perror("ctest: realloc");
+                exit(1);
+            }
+            for (j = 0; j < count; j++) {
+                if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC || syms[j].st_value == 0 || syms[j].st_size == 0) continue;
+                symbols[num_symbols].addr = (uintptr_t) syms[j].st_value + bias;
+                symbols[num_symbols].size = (size_t) syms[j].st_size;
+                num_symbols++;
+            }
+        }
+    }
+    munmap(map, size);
+    qsort(symbols, num_symbols, sizeof(struct ctest_symbol), cmp_symbol);
 }
+#else
+static void symbols_load(void) {}
 #endif
 
+static size_t function_size(uintptr_t addr) {
+    struct ctest_symbol key;
+    if (!symbols_loaded) {
+        symbols_load();
+        symbols_loaded = 1;
+    }
+    key.addr = addr;
+    const struct ctest_symbol* sym = (const struct ctest_symbol*) bsearch(&key, symbols, num_symbols, sizeof(struct ctest_symbol), cmp_symbol);
+    if (sym) return sym->size;
+    // don't read past the page, the next one might not be mapped
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const size_t left = (size_t) (page - addr % page);
+    return left < CTEST_IMPL_CODE_WINDOW ? left : CTEST_IMPL_CODE_WINDOW;
+}
+
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*) data;
+    while (size--) {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_code(uint64_t h, uintptr_t fn) {
+    return hash_bytes(h, (const void*) fn, function_size(fn));
+}
+
+static uint64_t test_fingerprint(const struct ctest* test) {
+    const struct ctest_suite* suite = suite_find(test->ssname);
+    uint64_t h = hash_name(test->ssname);
+    h = hash_code(h, (uintptr_t) test->run);
+    if (test->setup && *test->setup) h = hash_code(h, (uintptr_t) *test->setup);
+    if (test->teardown && *test->teardown) h = hash_code(h, (uintptr_t) *test->teardown);
+    if (suite && suite->setup) h = hash_code(h, (uintptr_t) suite->setup->run);
+    if (suite && suite->teardown) h = hash_code(h, (uintptr_t) suite->teardown->run);
+    if (test->param) h = hash_bytes(h, test->param, test->param_stride);
+    h = hash_bytes(h, &test->skip, sizeof(test->skip));
+    h = hash_bytes(h, &test->timeout, sizeof(test->timeout));
+    h = hash_bytes(h, &test->alloc_limit, sizeof(test->alloc_limit));
+    h = hash_bytes(h, &test->iterations, sizeof(test->iterations));
+    h = hash_bytes(h, &test->stress_threads, sizeof(test->stress_threads));
+    h = hash_bytes(h, &test->stress_ms, sizeof(test->stress_ms));
+    h = hash_bytes(h, &test->stress_count, sizeof(test->stress_count));
+    return h;
+}
+
+/*
+ * Drops the tests that passed last time and didn't change since. Tests that
+ * failed last time go first, the rest keeps its order.
+ */
+static int apply_changed_only(struct ctest** tests, int total) {
+    char name[256];
+    int i, n = 0, m = 0;
+    struct ctest** rest = (struct ctest**) malloc(sizeof(struct ctest*) * (size_t) (total + 1));
+    if (rest == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    for (i = 0; i < total; i++) {
+        test_fullname(tests[i], name, sizeof(name));
+        const struct ctest_state* st = state_find(name);
+        if (st && strcmp(st->status, "fail") == 0) tests[n++] = tests[i];
+        else if (st == NULL || strcmp(st->status, "ok") != 0 || st->fingerprint != test_fingerprint(tests[i])) rest[m++] = tests[i];
+    }
+    memcpy(tests + n, rest, sizeof(struct ctest*) * (size_t) m);
+    free(rest);
+    return n + m;
+}
+
+static void state_update(struct ctest** tests, const struct ctest_result* results, int total) {
+    char name[256];
+    int i;
+    for (i = 0; i < total; i++) {
+        const char* status = "fail";
+        if (results[i].status == CTEST_RESULT_OK) status = "ok";
+        else if (results[i].status == CTEST_RESULT_SKIP) status = "skip";
+        test_fullname(tests[i], name, sizeof(name));
+        struct ctest_state* st = state_find(name);
+        if (st == NULL) st = state_add(name);
+        if (st->updated && strcmp(st->status, "fail") == 0) continue;
+        st->fingerprint = test_fingerprint(tests[i]);
+        strcpy(st->status, status);
+        if (results[i].status != CTEST_RESULT_SKIP) st->duration = results[i].duration;
+        st->updated = 1;
+    }
+    qsort(states, num_states, sizeof(struct ctest_state), cmp_state);
+    num_sorted_states = num_states;
+}
+
+enum {
+    CTEST_PRIORITY_FAILED,      // failed last time
+    CTEST_PRIORITY_CHANGED,     // new or changed since it last ran
+    CTEST_PRIORITY_PASSED,
+};
+
+struct ctest_priority_item {
+    int index;
+    int rank;
+    uint64_t duration;
+};
+
+static int cmp_priority_item(const void* a, const void* b) {
+    const struct ctest_priority_item* x = (const struct ctest_priority_item*) a;
+    const struct ctest_priority_item* y = (const struct ctest_priority_item*) b;
+    if (x->rank != y->rank) return x->rank - y->rank;
+    if (x->duration != y->duration) return (x->duration > y->duration) - (x->duration < y->duration);
+    return x->index - y->index;
+}
+
+/*
+ * --prioritize: the tests most likely to fail go first, those that failed last
+ * time, then new and changed ones, and within each group the shortest first.
+ * Durations come from the state file, or the timing file for tests without
+ * one. A failure then shows up as early as possible, eg with --fail-fast.
+ */
+static void apply_priority(struct ctest** tests, int total) {
+    char name[256];
+    int i;
+    struct ctest_priority_item* items = (struct ctest_priority_item*) malloc(sizeof(struct ctest_priority_item) * (size_t) (total + 1));
+    struct ctest** sorted = (struct ctest**) malloc(sizeof(struct ctest*) * (size_t) (total + 1));
+    if (items == NULL || sorted == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    for (i = 0; i < total; i++) {
+        test_fullname(tests[i], name, sizeof(name));
+        const struct ctest_state* st = state_find(name);
+        const struct ctest_timing* t = timing_find(name);
+        items[i].index = i;
+        items[i].duration = st && st->duration ? st->duration : t ? t->duration : 0;
+        if (st && strcmp(st->status, "fail") == 0) items[i].rank = CTEST_PRIORITY_FAILED;
+        else if (st == NULL || st->fingerprint != test_fingerprint(tests[i])) items[i].rank = CTEST_PRIORITY_CHANGED;
+        else items[i].rank = CTEST_PRIORITY_PASSED;
+    }
+    qsort(items, (size_t) total, sizeof(struct ctest_priority_item), cmp_priority_item);
+    for (i = 0; i < total; i++) sorted[i] = tests[items[i].index];
+    memcpy(tests, sorted, sizeof(struct ctest*) * (size_t) total);
+    free(sorted);
+    free(items);
+}
+
+static struct ctest_result* slowest_results;
+
+static int cmp_slowest(const void* a, const void* b) {
+    const uint64_t x = slowest_results[*(const int*) a].duration;
+    const uint64_t y = slowest_results[*(const int*) b].duration;
+    return (x < y) - (x > y);
+}
+
+static void print_slowest(struct ctest** tests, struct ctest_result* results, int total, int count) {
+    int* order = (int*) malloc(sizeof(int) * (size_t) (total + 1));
+    int i, n = 0;
+    if (order == NULL) return;
+    for (i = 0; i < total; i++) {
+        if (results[i].status != CTEST_RESULT_SKIP) order[n++] = i;
+    }
+    slowest_results = results;
+    qsort(order, (size_t) n, sizeof(int), cmp_slowest);
+    if (count > n) count = n;
+    out_printf("SLOWEST %d tests:\n", count);
+    for (i = 0; i < count; i++) {
+        char duration[32];
+        format_duration(duration, sizeof(duration), results[order[i]].duration);
+        out_printf("  %10s  %s:%s\n", duration, tests[order[i]]->ssname, tests[order[i]]->ttname);
+    }
+    free(order);
+}
+
+/*
+ * --shuffle runs the tests in a random order, --repeat N runs them N times and
+ * --until-fail repeats until a round has a failure. Every round is shuffled
+ * again; the seed is printed so --shuffle=SEED replays the same orders.
+ */
+static int shuffle_tests;
+static uint64_t shuffle_seed;
+static uint64_t shuffle_state;
+static int repeat_count = 1;
+static int until_fail;
+
+struct ctest_repeat {
+    int passed;
+    int failed;
+    uint64_t* durations;
+    size_t count;
+    size_t cap;
+};
+
+// splitmix64
+static uint64_t shuffle_next(void) {
+    uint64_t z = (shuffle_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Fisher-Yates, the order of the previous round is the input of the next
+static void shuffle_order(int* order, int total) {
+    int i;
+    for (i = total - 1; i > 0; i--) {
+        const int j = (int) (shuffle_next() % (uint64_t) (i + 1));
+        const int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+static void repeat_add(struct ctest_repeat* stats, const struct ctest_result* r) {
+    if (r->status == CTEST_RESULT_SKIP) return;
+    if (r->status == CTEST_RESULT_OK) stats->passed++;
+    else stats->failed++;
+    if (stats->count == stats->cap) {
+        stats->cap = stats->cap ? stats->cap * 2 : 16;
+        stats->durations = (uint64_t*) realloc(stats->durations, sizeof(uint64_t) * stats->cap);
+        if (stats->durations == NULL) {
+            perror("ctest: realloc");
+            exit(1);
+        }
+    }
+    stats->durations[stats->count++] = r->duration;
+}
+
+static int cmp_uint64(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// pass/fail counts and min/median/max duration of every test over all rounds
+static void print_repeat(struct ctest** tests, struct ctest_repeat* stats, int total, int rounds) {
+    int i;
+    if (text_output) out_printf("REPEAT %d rounds:\n", rounds);
+    for (i = 0; i < total; i++) {
+        struct ctest_repeat* st = &stats[i];
+        char passed[32], lo[32], mid[32], hi[32];
+        if (st->count == 0) continue;
+        qsort(st->durations, st->count, sizeof(uint64_t), cmp_uint64);
+        const uint64_t median = st->durations[st->count / 2];
+        if (text_output) {
+            snprintf(passed, sizeof(passed), "%d/%d", st->passed, st->passed + st->failed);
+            format_duration(lo, sizeof(lo), st->durations[0]);
+            format_duration(mid, sizeof(mid), median);
+            format_duration(hi, sizeof(hi), st->durations[st->count - 1]);
+            out_printf("  %9s ok  min %10s  median %10s  max %10s  %s:%s%s\n",
+                passed, lo, mid, hi, tests[i]->ssname, tests[i]->ttname,
+                st->passed && st->failed ? "  (flaky)" : "");
+        }
+        if (output_format == CTEST_FORMAT_JSONL) {
+            fprintf(format_file, "{\"type\":\"repeat\",\"suite\":\"");
+            format_escaped(tests[i]->ssname, 0);
+            fprintf(format_file, "\",\"test\":\"");
+            format_escaped(tests[i]->ttname, 0);
+            fprintf(format_file, "\",\"passed\":%d,\"failed\":%d,\"min_ns\":%" PRIu64 ",\"median_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+                st->passed, st->failed, st->durations[0], median, st->durations[st->count - 1]);
+        }
+        free(st->durations);
+    }
+}
+
+/*
+ * Baseline file: one "<mean> <stddev> <runs> <suite>:<test>" line per passing
+ * test, in ns per run or ns/op for benchmarks. --compare-baseline flags tests
+ * that got more than baseline_threshold % slower, if Welch's t-test agrees
+ * that the difference isn't noise.
+ */
+struct ctest_baseline {
+    char* name;
+    struct ctest_samples samples;
+};
+
+static struct ctest_baseline* baselines;
+static size_t num_baselines;
+
+static int cmp_baseline(const void* a, const void* b) {
+    return strcmp(((const struct ctest_baseline*) a)->name, ((const struct ctest_baseline*) b)->name);
+}
+
+static int baseline_load(const char* filename) {
+    char line[1024];
+    size_t cap = 0;
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        perror(filename);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct ctest_baseline b;
+        int pos = 0;
+        if (sscanf(line, "%lf %lf %d %n", &b.samples.mean, &b.samples.stddev, &b.samples.n, &pos) != 3 || pos == 0) continue;
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[pos] == 0) continue;
+        if (num_baselines == cap) {
+            cap = cap ? cap * 2 : 256;
+            baselines = (struct ctest_baseline*) realloc(baselines, sizeof(struct ctest_baseline) * cap);
+            if (baselines == NULL) {
+                perror("ctest: realloc");
+                exit(1);
+            }
+        }
+        b.name = strdup(line + pos);
+        baselines[num_baselines++] = b;
+    }
+    fclose(f);
+    qsort(baselines, num_baselines, sizeof(struct ctest_baseline), cmp_baseline);
+    return 1;
+}
+
+static void baseline_save(const char* filename, struct ctest** tests, const struct ctest_result* results, int total) {
+    char name[256];
+    int i;
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        perror(filename);
+        return;
+    }
+    for (i = 0; i < total; i++) {
+        const struct ctest_samples* s = &results[i].samples;
+        if (results[i].status != CTEST_RESULT_OK || s->n == 0) continue;
+        test_fullname(tests[i], name, sizeof(name));
+        fprintf(f, "%.3f %.3f %d %s\n", s->mean, s->stddev, s->n, name);
+    }
+    fclose(f);
+}
+
+// one-sided 95% critical value of Student's t distribution
+static double t_critical(double df) {
+    static const double table[] = { 6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812 };
+    if (df < 1) return table[0];
+    if (df <= 10) return table[(int) df - 1];
+    if (df <= 15) return 1.753;
+    if (df <= 20) return 1.725;
+    if (df <= 30) return 1.697;
+    return 1.645;
+}
+
+// returns the number of tests that got slower
+static int baseline_compare(struct ctest** tests, const struct ctest_result* results, int total) {
+    char name[256];
+    int num_compared = 0, num_slower = 0, num_faster = 0, num_new = 0;
+    int i;
+    for (i = 0; i < total; i++) {
+        const struct ctest_samples* cur = &results[i].samples;
+        struct ctest_baseline key;
+        const char* status;
+        const char* color = NULL;
+        double t = 0;
+        if (results[i].status != CTEST_RESULT_OK || cur->n == 0) continue;
+        test_fullname(tests[i], name, sizeof(name));
+        key.name = name;
+        const struct ctest_baseline* base = (const struct ctest_baseline*) bsearch(&key, baselines, num_baselines, sizeof(struct ctest_baseline), cmp_baseline);
+        if (base == NULL) {
+            num_new++;
+            if (text_output) out_printf("BASELINE new %s cur_ns=%.2f\n", name, cur->mean);
+            if (output_format == CTEST_FORMAT_JSONL) {
+                fprintf(format_file, "{\"type\":\"baseline\",\"suite\":\"");
+                format_escaped(tests[i]->ssname, 0);
+                fprintf(format_file, "\",\"test\":\"");
+                format_escaped(tests[i]->ttname, 0);
+                fprintf(format_file, "\",\"status\":\"new\",\"cur_ns\":%.3f}\n", cur->mean);
+            }
+            continue;
+        }
+        num_compared++;
+        const struct ctest_samples* old = &base->samples;
+        const double delta = old->mean > 0 ? (cur->mean - old->mean) / old->mean * 100 : 0;
+        const double v1 = old->n > 1 ? old->stddev * old->stddev / old->n : 0;
+        const double v2 = cur->n > 1 ? cur->stddev * cur->stddev / cur->n : 0;
+        double critical = 0;    // without samples only the threshold counts
+        if (v1 + v2 > 0) {
+            t = (cur->mean - old->mean) / bench_sqrt(v1 + v2);
+            // Welch-Satterthwaite degrees of freedom
+            const double df = (v1 + v2) * (v1 + v2) /
+                ((old->n > 1 ? v1 * v1 / (old->n - 1) : 0) + (cur->n > 1 ? v2 * v2 / (cur->n - 1) : 0));
+            critical = t_critical(df);
+        }
+        if (delta > baseline_threshold && (v1 + v2 == 0 || t > critical)) {
+            status = "slower";
+            color = ANSI_BRED;
+            num_slower++;
+        } else if (delta < -baseline_threshold && (v1 + v2 == 0 || t < -critical)) {
+            status = "faster";
+            color = ANSI_BGREEN;
+            num_faster++;
+        } else {
+            status = "same";
+        }
+        if (text_output && color) {
+            char line[512];
+            snprintf(line, sizeof(line), "BASELINE %s %s base_ns=%.2f cur_ns=%.2f delta=%+.1f%% t=%.2f",
+                status, name, old->mean, cur->mean, delta, t);
+            color_print(color, line);
+        }
+        if (output_format == CTEST_FORMAT_JSONL) {
+            fprintf(format_file, "{\"type\":\"baseline\",\"suite\":\"");
+            format_escaped(tests[i]->ssname, 0);
+            fprintf(format_file, "\",\"test\":\"");
+            format_escaped(tests[i]->ttname, 0);
+            fprintf(format_file, "\",\"status\":\"%s\",\"base_ns\":%.3f,\"cur_ns\":%.3f,\"delta_pct\":%.2f,\"t\":%.2f}\n",
+                status, old->mean, cur->mean, delta, t);
+        }
+    }
+    if (text_output) {
+        char summary[256];
+        snprintf(summary, sizeof(summary), "BASELINE: %d compared, %d slower, %d faster, %d new (threshold %.1f%%)",
+            num_compared, num_slower, num_faster, num_new, baseline_threshold);
+        color_print(num_slower ? ANSI_BRED : ANSI_GREEN, summary);
+    }
+    return num_slower;
+}
+
+// returns the number of tests that ran, less than total when the run stopped early
+static int run_sequential(struct ctest** tests, int total, struct ctest_result* results) {
+    int i;
+    for (i = 0; i < total; i++) {
+        struct ctest_result* r = &results[i];
+        struct ctest* test = tests[i];
+        const size_t mark = out_len;
+        const unsigned int flushes = out_flushes;
+        reset_errorbuffer();
+        // the header is buffered before the test runs, so a crash or ^C still shows it
+        print_test_header(i+1, total, test);
+        if (text_output && !test->skip) out_test_begin();
+        if (test->skip) {
+            r->status = CTEST_RESULT_SKIP;
+        } else if (suite_begin(test) != CTEST_RESULT_OK) {
+            r->status = CTEST_RESULT_FAIL;
+        } else {
+            r->status = run_sampled(test, &r->duration);
+            r->file = ctest_fail_file;
+            r->line = ctest_fail_line;
+            r->mem = ctest_mem;
+            r->perf = ctest_perf;
+            r->samples = ctest_samples;
+        }
+        if (text_output && !test->skip) out_test_end();
+        if (quiet_output && !result_failed(r) && flushes == out_flushes) {
+            out_len = mark;     // take the header back
+            if (format_file) format_result(test, r, ctest_errorlen ? ctest_errorbuffer : NULL);
+        } else {
+            report_result(test, r, ctest_errorlen ? ctest_errorbuffer : NULL);
+        }
+        suite_end(test);
+        out_tick();
+        if (stop_after(r)) return i + 1;
+    }
+    return total;
+}
+
 int ctest_main(int argc, const char *argv[]);
 
 int ctest_main(int argc, const char *argv[])
 {
-    static int total = 0;
-    static int num_ok = 0;
-    static int num_fail = 0;
-    static int num_skip = 0;
-    static int idx = 1;
-    static ctest_filter_func filter = suite_all;
+    int total = 0;
+    int num_ok = 0;
+    int num_fail = 0;
+    int num_skip = 0;
+    int num_slowest = 0;
+    int num_slower = 0;
+    int num_unchanged = 0;
+    int num_not_run = 0;
+    const char* output_file = NULL;
+    const char* log_file = NULL;
+    int list_only = 0;
+    int shuffle_seed_set = 0;
+    int repeat_set = 0;
+    ctest_filter_func filter = suite_all;
+    int i;
+
+    // CI runners can inject the shard through the environment
+    if (getenv("CTEST_SHARD_INDEX")) shard_index = atoi(getenv("CTEST_SHARD_INDEX"));
+    if (getenv("CTEST_SHARD_COUNT")) shard_count = atoi(getenv("CTEST_SHARD_COUNT"));
+    if (getenv("CTEST_TIMING_FILE")) timing_file = getenv("CTEST_TIMING_FILE");
 
+    static const int flush_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM };
+    for (i = 0; i < (int) (sizeof(flush_signals) / sizeof(flush_signals[0])); i++) {
+        set_handler(flush_signals[i], out_sighandler);
+    }
 #ifdef CTEST_SEGFAULT
-    signal(SIGSEGV, sighandler);
+    set_handler(SIGSEGV, sighandler);
 #endif
+    fflush(stdout);         // anything printed before goes out before the tests
+    atexit(out_atexit);     // a test that calls exit()
+    ctest_main_thread = pthread_self();
+    ctest_jmp_ready = 1;
+    mismatch_init();
+    out_flushed = getCurrentTime();
+    struct sigaction alarm_action;
+    memset(&alarm_action, 0, sizeof(alarm_action));
+    alarm_action.sa_handler = timeout_handler;
+    alarm_action.sa_flags = SA_NODEFER;    // we longjmp out of the handler
+    sigaction(SIGALRM, &alarm_action, NULL);
 
-    if (argc == 2) {
-        suite_name = argv[1];
-        filter = suite_filter;
+    for (i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "-j", 2) == 0 && (arg[2] == 0 || (arg[2] >= '0' && arg[2] <= '9'))) {
+            // -j N, -jN or plain -j (one job per cpu)
+            if (arg[2] == 0 && i+1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9') {
+                num_jobs = parse_jobs(argv[++i]);
+            } else {
+                num_jobs = parse_jobs(arg+2);
+            }
+        } else if (strcmp(arg, "--fork") == 0) {
+            fork_mode = 1;
+        } else if (strcmp(arg, "--batch") == 0 && i+1 < argc) {
+            batch_size = atoi(argv[++i]);
+            fork_mode = 1;
+        } else if (strncmp(arg, "--batch=", 8) == 0) {
+            batch_size = atoi(arg+8);
+            fork_mode = 1;
+        } else if (strcmp(arg, "--seed") == 0 && i+1 < argc) {
+            property_seed = strtoull(argv[++i], NULL, 10);
+            property_seed_set = 1;
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            property_seed = strtoull(arg+7, NULL, 10);
+            property_seed_set = 1;
+        } else if (strcmp(arg, "--shuffle") == 0) {
+            // --shuffle SEED, a suite name can't start with a digit
+            shuffle_tests = 1;
+            if (i+1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9') {
+                shuffle_seed = strtoull(argv[++i], NULL, 10);
+                shuffle_seed_set = 1;
+            }
+        } else if (strncmp(arg, "--shuffle=", 10) == 0) {
+            shuffle_tests = 1;
+            shuffle_seed = strtoull(arg+10, NULL, 10);
+            shuffle_seed_set = 1;
+        } else if (strcmp(arg, "--repeat") == 0 && i+1 < argc) {
+            repeat_count = atoi(argv[++i]);
+            repeat_set = 1;
+        } else if (strncmp(arg, "--repeat=", 9) == 0) {
+            repeat_count = atoi(arg+9);
+            repeat_set = 1;
+        } else if (strcmp(arg, "--until-fail") == 0) {
+            until_fail = 1;
+        } else if (strcmp(arg, "--quiet") == 0 || strcmp(arg, "-q") == 0) {
+            quiet_output = 1;
+        } else if (strcmp(arg, "--perf") == 0) {
+            perf_counters = 1;
+        } else if (strcmp(arg, "--bench") == 0) {
+            run_benchmarks = 1;
+        } else if (strcmp(arg, "--timeout") == 0 && i+1 < argc) {
+            default_timeout = (unsigned int) atoi(argv[++i]);
+            fork_mode = 1;
+        } else if (strncmp(arg, "--timeout=", 10) == 0) {
+            default_timeout = (unsigned int) atoi(arg+10);
+            fork_mode = 1;
+        } else if (strncmp(arg, "--format=", 9) == 0 || (strcmp(arg, "--format") == 0 && i+1 < argc)) {
+            const char* format = arg[8] == '=' ? arg+9 : argv[++i];
+            if (strcmp(format, "junit") == 0) output_format = CTEST_FORMAT_JUNIT;
+            else if (strcmp(format, "jsonl") == 0) output_format = CTEST_FORMAT_JSONL;
+            else if (strcmp(format, "text") == 0) output_format = CTEST_FORMAT_TEXT;
+            else {
+                fprintf(stderr, "ctest: unknown format '%s'\n", format);
+                return 1;
+            }
+        } else if (strcmp(arg, "--output") == 0 && i+1 < argc) {
+            output_file = argv[++i];
+        } else if (strncmp(arg, "--output=", 9) == 0) {
+            output_file = arg+9;
+        } else if (strncmp(arg, "--log-level=", 12) == 0 || (strcmp(arg, "--log-level") == 0 && i+1 < argc)) {
+            const char* level = arg[11] == '=' ? arg+12 : argv[++i];
+            for (log_level = CTEST_IMPL_LOG_DEBUG; log_level < CTEST_IMPL_LOG_ERR; log_level++) {
+                if (strcmp(level, log_names[log_level]) == 0) break;
+            }
+            if (log_level == CTEST_IMPL_LOG_ERR) {
+                fprintf(stderr, "ctest: unknown log level '%s'\n", level);
+                return 1;
+            }
+        } else if (strcmp(arg, "--log-file") == 0 && i+1 < argc) {
+            log_file = argv[++i];
+        } else if (strncmp(arg, "--log-file=", 11) == 0) {
+            log_file = arg+11;
+        } else if (strcmp(arg, "--filter") == 0 && i+1 < argc) {
+            pattern_add(&filters, &num_filters, argv[++i]);
+        } else if (strncmp(arg, "--filter=", 9) == 0) {
+            pattern_add(&filters, &num_filters, arg+9);
+        } else if (strcmp(arg, "--exclude") == 0 && i+1 < argc) {
+            pattern_add(&excludes, &num_excludes, argv[++i]);
+        } else if (strncmp(arg, "--exclude=", 10) == 0) {
+            pattern_add(&excludes, &num_excludes, arg+10);
+        } else if (strcmp(arg, "--list") == 0) {
+            list_only = 1;
+        } else if (strcmp(arg, "--shard-index") == 0 && i+1 < argc) {
+            shard_index = atoi(argv[++i]);
+        } else if (strncmp(arg, "--shard-index=", 14) == 0) {
+            shard_index = atoi(arg+14);
+        } else if (strcmp(arg, "--shard-count") == 0 && i+1 < argc) {
+            shard_count = atoi(argv[++i]);
+        } else if (strncmp(arg, "--shard-count=", 14) == 0) {
+            shard_count = atoi(arg+14);
+        } else if (strcmp(arg, "--timing-file") == 0 && i+1 < argc) {
+            timing_file = argv[++i];
+        } else if (strncmp(arg, "--timing-file=", 14) == 0) {
+            timing_file = arg+14;
+        } else if (strcmp(arg, "--save-timing") == 0 && i+1 < argc) {
+            save_timing_file = argv[++i];
+        } else if (strncmp(arg, "--save-timing=", 14) == 0) {
+            save_timing_file = arg+14;
+        } else if (strcmp(arg, "--changed-only") == 0) {
+            changed_only = 1;
+        } else if (strncmp(arg, "--changed-only=", 15) == 0) {
+            changed_only = 1;
+            state_file = arg+15;
+        } else if (strcmp(arg, "--prioritize") == 0) {
+            prioritize = 1;
+        } else if (strcmp(arg, "--state-file") == 0 && i+1 < argc) {
+            state_file = argv[++i];
+        } else if (strncmp(arg, "--state-file=", 13) == 0) {
+            state_file = arg+13;
+        } else if (strcmp(arg, "--fail-fast") == 0) {
+            max_failures = 1;
+        } else if (strcmp(arg, "--max-failures") == 0 && i+1 < argc) {
+            max_failures = atoi(argv[++i]);
+        } else if (strncmp(arg, "--max-failures=", 15) == 0) {
+            max_failures = atoi(arg+15);
+        } else if (strcmp(arg, "--save-baseline") == 0 && i+1 < argc) {
+            save_baseline_file = argv[++i];
+        } else if (strncmp(arg, "--save-baseline=", 16) == 0) {
+            save_baseline_file = arg+16;
+        } else if (strcmp(arg, "--compare-baseline") == 0 && i+1 < argc) {
+            compare_baseline_file = argv[++i];
+        } else if (strncmp(arg, "--compare-baseline=", 19) == 0) {
+            compare_baseline_file = arg+19;
+        } else if (strcmp(arg, "--threshold") == 0 && i+1 < argc) {
+            baseline_threshold = atof(argv[++i]);
+        } else if (strncmp(arg, "--threshold=", 12) == 0) {
+            baseline_threshold = atof(arg+12);
+        } else if (strcmp(arg, "--baseline-runs") == 0 && i+1 < argc) {
+            baseline_runs = atoi(argv[++i]);
+        } else if (strncmp(arg, "--baseline-runs=", 16) == 0) {
+            baseline_runs = atoi(arg+16);
+        } else if (strcmp(arg, "--slowest") == 0 && i+1 < argc) {
+            num_slowest = atoi(argv[++i]);
+        } else if (strncmp(arg, "--slowest=", 10) == 0) {
+            num_slowest = atoi(arg+10);
+        } else if (arg[0] == '-') {
+            // a typo must not quietly select no tests at all
+            fprintf(stderr, "ctest: unknown option or missing value '%s'\nusage: %s [options] [suite]\n", arg, argv[0]);
+            return 1;
+        } else if (arg[0] >= '0' && arg[0] <= '9') {
+            // the value of an option that doesn't take one, not a suite name
+            fprintf(stderr, "ctest: unexpected value '%s'\nusage: %s [options] [suite]\n", arg, argv[0]);
+            return 1;
+        } else {
+            suite_name = arg;
+            filter = suite_filter;
+        }
+    }
+    if (batch_size < 1) batch_size = 1;
+    if (baseline_runs < 1) baseline_runs = 1;
+    if (!property_seed_set) property_seed = (getCurrentTime() ^ ((uint64_t) getpid() << 32)) % 1000000000;
+    if (!shuffle_seed_set) shuffle_seed = (getCurrentTime() ^ ((uint64_t) getpid() << 32)) % 1000000000;
+    if (repeat_count < 1) repeat_count = 1;
+    if (until_fail && !repeat_set) repeat_count = INT_MAX;  // --repeat N caps --until-fail
+    if ((changed_only || prioritize) && state_file == NULL) state_file = CTEST_IMPL_STATE_FILE;
+    if (compare_baseline_file && !baseline_load(compare_baseline_file)) return 1;
+    if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+        fprintf(stderr, "ctest: invalid shard %d of %d\n", shard_index, shard_count);
+        return 1;
+    }
+    if (log_file) {
+        // O_APPEND: lines written by parallel children don't overwrite each other
+        log_fd = open(log_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (log_fd < 0) {
+            perror(log_file);
+            return 1;
+        }
+    }
+    if (output_format != CTEST_FORMAT_TEXT) {
+        // records go to the --output file, or replace the text on stdout
+        if (output_file) {
+            format_file = fopen(output_file, "w");
+            if (format_file == NULL) {
+                perror(output_file);
+                return 1;
+            }
+        } else {
+            format_file = stdout;
+            text_output = 0;
+        }
     }
+    out_tty = isatty(1);
 #ifdef CTEST_NO_COLORS
     color_output = 0;
 #else
-    color_output = isatty(1);
+    color_output = text_output && out_tty;
 #endif
     uint64_t t1 = getCurrentTime();
 
-    struct ctest* ctest_begin = &CTEST_IMPL_TNAME(suite, test);
-    struct ctest* ctest_end = &CTEST_IMPL_TNAME(suite, test);
-    // find begin and end of section by comparing magics
-    while (1) {
-        struct ctest* t = ctest_begin-1;
-        if (t->magic != CTEST_IMPL_MAGIC) break;
-        ctest_begin--;
+    if (ctest_table == NULL) table_init();
+
+    struct ctest* test;
+    for (i = 0; i < ctest_table_size; i++) {
+        if (test_selected(filter, ctest_table[i])) total++;
     }
-    while (1) {
-        struct ctest* t = ctest_end+1;
-        if (t->magic != CTEST_IMPL_MAGIC) break;
-        ctest_end++;
-    }
-    ctest_end++;    // end after last one
-
-    static struct ctest* test;
-    for (test = ctest_begin; test != ctest_end; test++) {
-        if (test == &CTEST_IMPL_TNAME(suite, test)) continue;
-        if (filter(test)) total++;
-    }
-
-    for (test = ctest_begin; test != ctest_end; test++) {
-        if (test == &CTEST_IMPL_TNAME(suite, test)) continue;
-        if (filter(test)) {
-            ctest_errorbuffer[0] = 0;
-            ctest_errorsize = MSG_SIZE-1;
-            ctest_errormsg = ctest_errorbuffer;
-            printf("TEST %d/%d %s:%s ", idx, total, test->ssname, test->ttname);
-            fflush(stdout);
-            if (test->skip) {
-                color_print(ANSI_BYELLOW, "[SKIPPED]");
-                num_skip++;
-            } else {
-                int result = setjmp(ctest_err);
-                if (result == 0) {
-                    if (test->setup && *test->setup) (*test->setup)(test->data);
-                    if (test->data)
-                        test->run(test->data);
-                    else
-                        test->run();
-                    if (test->teardown && *test->teardown) (*test->teardown)(test->data);
-                    // if we got here it's ok
-#ifdef CTEST_COLOR_OK
-                    color_print(ANSI_BGREEN, "[OK]");
-#else
-                    printf("[OK]\n");
-#endif
-                    num_ok++;
-                } else {
-                    color_print(ANSI_BRED, "[FAIL]");
-                    num_fail++;
-                }
-                if (ctest_errorsize != MSG_SIZE-1) printf("%s", ctest_errorbuffer);
+
+    struct ctest** tests = (struct ctest**) malloc(sizeof(struct ctest*) * (size_t) (total + 1));
+    struct ctest_result* results = (struct ctest_result*) calloc((size_t) total + 1, sizeof(struct ctest_result));
+    if (tests == NULL || results == NULL) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    total = 0;
+    for (i = 0; i < ctest_table_size; i++) {
+        if (test_selected(filter, ctest_table[i])) tests[total++] = ctest_table[i];
+    }
+
+    if (timing_file) timing_load(timing_file);
+    if (shard_count > 1) total = apply_shard(tests, total);
+
+    if (list_only) {
+        for (i = 0; i < total; i++) {
+            test = tests[i];
+            if (test->tags) out_printf("%s:%s [%s]\n", test->ssname, test->ttname, test->tags);
+            else out_printf("%s:%s\n", test->ssname, test->ttname);
+        }
+        out_flush();
+        free(tests);
+        free(results);
+        return 0;
+    }
+
+    if (state_file) state_load(state_file);
+    if (changed_only) {
+        const int selected = total;
+        total = apply_changed_only(tests, total);
+        num_unchanged = selected - total;
+    }
+    if (prioritize) apply_priority(tests, total);
+
+    if (format_file) format_begin();
+    if (num_unchanged > 0) {
+        if (text_output) out_printf("UNCHANGED: %d tests passed last time and didn't change, not running them\n", num_unchanged);
+        if (output_format == CTEST_FORMAT_JSONL) fprintf(format_file, "{\"type\":\"unchanged\",\"count\":%d}\n", num_unchanged);
+    }
+    if (shuffle_tests) {
+        shuffle_state = shuffle_seed;
+        if (text_output) out_printf("SHUFFLE: seed %" PRIu64 ", replay with --shuffle=%" PRIu64 "\n", shuffle_seed, shuffle_seed);
+        if (output_format == CTEST_FORMAT_JSONL) fprintf(format_file, "{\"type\":\"shuffle\",\"seed\":%" PRIu64 "}\n", shuffle_seed);
+    }
+    // tests[] keeps the section order, round[] is the order of the current round
+    const int repeating = repeat_count > 1 || until_fail;
+    struct ctest** round = (struct ctest**) malloc(sizeof(struct ctest*) * (size_t) (total + 1));
+    int* order = (int*) malloc(sizeof(int) * (size_t) (total + 1));
+    struct ctest_repeat* stats = repeating ? (struct ctest_repeat*) calloc((size_t) total + 1, sizeof(struct ctest_repeat)) : NULL;
+    if (round == NULL || order == NULL || (repeating && stats == NULL)) {
+        perror("ctest: malloc");
+        exit(1);
+    }
+    for (i = 0; i < total; i++) order[i] = i;
+    int rounds = 0;
+    int ran = 0;
+    int num_runs = 0;
+    while (rounds < repeat_count) {
+        int round_failed = 0;
+        rounds++;
+        if (shuffle_tests) shuffle_order(order, total);
+        for (i = 0; i < total; i++) round[i] = tests[order[i]];
+        memset(results, 0, sizeof(struct ctest_result) * (size_t) total);
+        if (repeating && text_output && !quiet_output) {
+            if (repeat_count == INT_MAX) out_printf("ROUND %d\n", rounds);
+            else out_printf("ROUND %d/%d\n", rounds, repeat_count);
+        }
+        suite_count(round, total);
+        if (num_jobs > 1 || fork_mode) {
+            ran = run_parallel(round, total, results);
+        } else {
+            ran = run_sequential(round, total, results);
+        }
+        num_runs += ran;
+        for (i = 0; i < ran; i++) {
+            if (results[i].status == CTEST_RESULT_OK) num_ok++;
+            else if (results[i].status == CTEST_RESULT_SKIP) num_skip++;
+            else {
+                num_fail++;
+                round_failed = 1;
             }
-            idx++;
+            if (repeating) repeat_add(&stats[order[i]], &results[i]);
         }
+        if (state_file) state_update(round, results, ran);
+        if (ran < total) {
+            num_not_run = total - ran;
+            suite_stop();
+        }
+        if (until_fail && round_failed) break;
+        if (max_failures > 0 && num_run_failures >= max_failures) break;
+    }
+    // the per-test reports are about the last round
+    if (num_slowest > 0 && text_output) print_slowest(round, results, ran, num_slowest);
+    if (state_file) state_save(state_file);
+    if (save_timing_file) {
+        timing_update(round, results, ran);
+        timing_save(save_timing_file);
     }
+    if (compare_baseline_file) num_slower = baseline_compare(round, results, ran);
+    if (save_baseline_file) baseline_save(save_baseline_file, round, results, ran);
+    if (repeating) print_repeat(tests, stats, total, rounds);
+    total = num_runs;
+    free(stats);
+    free(order);
+    free(round);
+    free(tests);
+    free(results);
+
     uint64_t t2 = getCurrentTime();
+    if (format_file) {
+        format_end(total, num_ok, num_fail, num_skip, num_not_run, t2 - t1);
+        if (format_file != stdout) fclose(format_file);
+    }
+    // a slower test or a failed suite teardown fails the run just like a failing test
+    if (!text_output) {
+        out_flush();
+        return num_fail + num_slower + num_suite_failures;
+    }
 
-    const char* color = (num_fail) ? ANSI_BRED : ANSI_GREEN;
-    char results[80];
-    sprintf(results, "RESULTS: %d tests (%d ok, %d failed, %d skipped) ran in %" PRIu64 " ms", total, num_ok, num_fail, num_skip, (t2 - t1)/1000);
-    color_print(color, results);
-    return num_fail;
+    const char* color = (num_fail || num_suite_failures) ? ANSI_BRED : ANSI_GREEN;
+    char summary[160];
+    char runs[64] = "";
+    if (rounds > 1) snprintf(runs, sizeof(runs), " in %d rounds", rounds);
+    int len = snprintf(summary, sizeof(summary), "RESULTS: %d tests%s (%d ok, %d failed, %d skipped) ran in %" PRIu64 " ms", total, runs, num_ok, num_fail, num_skip, (t2 - t1)/1000000);
+    if (num_suite_failures > 0 && len > 0 && (size_t) len < sizeof(summary)) {
+        len += snprintf(summary + len, sizeof(summary) - (size_t) len, ", suite teardowns failed: %d", num_suite_failures);
+    }
+    if (num_unchanged > 0 && len > 0 && (size_t) len < sizeof(summary)) {
+        len += snprintf(summary + len, sizeof(summary) - (size_t) len, ", %d unchanged", num_unchanged);
+    }
+    if (num_not_run > 0 && len > 0 && (size_t) len < sizeof(summary)) {
+        snprintf(summary + len, sizeof(summary) - (size_t) len, ", stopped early: %d not run", num_not_run);
+    }
+    color_print(color, summary);
+    out_flush();
+    return num_fail + num_slower + num_suite_failures;
 }
 
 #endif
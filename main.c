@@ -4,6 +4,7 @@
 
 // uncomment lines below to enable/disable features. See README.md for details
 #define CTEST_SEGFAULT
+//#define CTEST_MEMORY
 //#define CTEST_NO_COLORS
 //#define CTEST_COLOR_OK
 
@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ctest.h"
 
 // basic test without setup/teardown
@@ -19,6 +20,67 @@ CTEST(suite2, test1) {
 CTEST(suite3, test3) {
 }
 
+// log levels: CTEST_DEBUG messages are only shown with --log-level=debug
+CTEST(suite3, logging) {
+    int i;
+    CTEST_DEBUG("starting");
+    for (i = 0; i < 3; i++) CTEST_LOG("step %d", i);
+    CTEST_WARN("done in %d steps", i);
+}
+
+// tags can be used to select tests, eg --filter=@slow or --exclude=@slow
+CTEST_TAGGED(suite3, tagged, "slow,example") {
+    usleep(1000);
+}
+
+// tests that don't finish within their timeout (in ms) are reported as [TIMEOUT]
+CTEST_TIMEOUT(suite3, hang, 50) {
+    while (1) usleep(1000);
+}
+
+
+// table driven tests: the body runs once per row, each row is reported as its own test
+static const struct {
+    int a, b, sum;
+} add_cases[] = {
+    { 1, 2, 3 },
+    { -1, 1, 0 },
+    { 1000, 2000, 3000 },
+    { 2, 2, 5 },
+};
+
+CTEST_PARAM(param, add, add_cases) {
+    ASSERT_EQUAL(param->sum, param->a + param->b);
+}
+
+
+// property tests: the body runs with random values, a failure is shrunk to a minimal input
+CTEST_PROPERTY(property, add_commutes, 1000) {
+    int64_t a = ctest_gen_int(-1000000, 1000000);
+    int64_t b = ctest_gen_int(-1000000, 1000000);
+    ASSERT_EQUAL(a + b, b + a);
+}
+
+// reverses a string in place, but has a bug for strings longer than 8
+static void reverse(char* s) {
+    size_t n = strlen(s);
+    if (n > 8) n = 8;
+    for (size_t i = 0; i < n / 2; i++) {
+        char c = s[i];
+        s[i] = s[n - 1 - i];
+        s[n - 1 - i] = c;
+    }
+}
+
+CTEST_PROPERTY(property, reverse, 1000) {
+    char text[32];
+    size_t len = ctest_gen_string(text, sizeof(text));
+    if (len == 0) return;
+    char last = text[len - 1];
+    reverse(text);
+    ASSERT_EQUAL(last, text[0]);
+}
+
 
 // A test suite with a setup/teardown function
 // This is converted into a struct that's automatically passed to all tests in the suite
@@ -53,6 +115,91 @@ CTEST2(memtest, test2) {
     ASSERT_FAIL();
 }
 
+// With CTEST_MEMORY, run() may allocate at most the given number of bytes.
+// The buffer allocated in setup doesn't count.
+CTEST2_ALLOC_LIMIT(memtest, no_alloc, 0) {
+    memset(data->buffer, 0, 1024);
+}
+
+// With CTEST_MEMORY, memory that is still allocated after the test is reported
+CTEST(memory, leak) {
+    char* p = (char*)malloc(100);
+    CTEST_BENCH_KEEP(p);
+}
+
+CTEST_ALLOC_LIMIT(memory, over_limit, 64) {
+    char* p = (char*)malloc(128);
+    CTEST_BENCH_KEEP(p);
+    free(p);
+}
+
+
+// Suite setup runs once, before the first test of the suite that runs.
+// Its state is shared by all tests of the suite, which should only read it.
+static int* shared_table;
+
+CTEST_SUITE_SETUP(shared) {
+    int i;
+    shared_table = (int*)malloc(100 * sizeof(int));
+    ASSERT_NOT_NULL(shared_table);
+    for (i = 0; i < 100; i++) shared_table[i] = i * i;
+}
+
+// Suite teardown runs once, after the last test of the suite
+CTEST_SUITE_TEARDOWN(shared) {
+    free(shared_table);
+    shared_table = NULL;
+}
+
+CTEST(shared, lookup) {
+    ASSERT_EQUAL(81, shared_table[9]);
+}
+
+CTEST(shared, last) {
+    ASSERT_EQUAL(9801, shared_table[99]);
+}
+
+
+// Asserts work on other threads too, a failure ends only that thread.
+// ctest_run_threads() starts the threads, joins them and fails the test if one failed.
+static void add_to_counter(int index, void* arg) {
+    int i;
+    for (i = 0; i < 1000; i++) __atomic_add_fetch((int*)arg, 1, __ATOMIC_RELAXED);
+    ASSERT_TRUE(index < 4);
+}
+
+CTEST(threads, counter) {
+    int counter = 0;
+    ctest_run_threads(4, add_to_counter, &counter);
+    ASSERT_EQUAL(4000, counter);
+}
+
+
+// stress tests: the body runs over and over on 4 threads for 50 ms,
+// the result shows the throughput and the latency percentiles
+static long stress_counter;
+
+CTEST_STRESS(threads, atomic_increment, 4, 50) {
+    long before = __atomic_fetch_add(&stress_counter, 1, __ATOMIC_RELAXED);
+    ASSERT_TRUE(before >= 0);
+}
+
+
+// latency assertions: record timings in a histogram, then check its percentiles
+CTEST(latency, memset) {
+    static struct ctest_hist hist;
+    static char buf[4096];
+    int i;
+    for (i = 0; i < 10000; i++) {
+        const uint64_t start = ctest_now_ns();
+        memset(buf, i, sizeof(buf));
+        CTEST_BENCH_KEEP(buf);
+        ctest_hist_record(&hist, ctest_now_ns() - start);
+    }
+    ASSERT_LATENCY_P50(&hist, 100000);
+    ASSERT_LATENCY_P99(&hist, 1000000);
+}
+
 
 CTEST_DATA(fail) {};
 
@@ -190,8 +337,112 @@ CTEST(ctest, test_dbl_near_tol) {
     ASSERT_DBL_NEAR_TOL(0.0001, a, 1e-5); /* will fail */
 }
 
+CTEST(ctest, test_assert_data) {
+    unsigned char exp[100];
+    unsigned char real[100];
+    for (int i = 0; i < 100; i++) exp[i] = real[i] = (unsigned char)i;
+    ASSERT_DATA(exp, sizeof(exp), real, sizeof(real));
+    real[37] = 0xff;
+    real[40] = 0xff;
+    ASSERT_DATA(exp, sizeof(exp), real, sizeof(real));
+}
+
 CTEST(ctest, test_dbl_far) {
     double a = 1.1;
     ASSERT_DBL_FAR(1., a);
     ASSERT_DBL_FAR_TOL(1., a, 0.01);
 }
+
+
+// Benchmarks are only run with --bench. The body has to perform the measured
+// operation 'iterations' times, ctest picks the count and reports ns/op
+CTEST_BENCH(bench, memset_4k) {
+    unsigned char buf[4096];
+    for (size_t i = 0; i < iterations; i++) {
+        memset(buf, (int)i, sizeof(buf));
+        CTEST_BENCH_KEEP(buf);
+    }
+}
+
+CTEST_DATA(benchdata) {
+    unsigned char* src;
+    unsigned char* dst;
+};
+
+// setup/teardown run once around all samples of a benchmark
+CTEST_SETUP(benchdata) {
+    data->src = (unsigned char*)calloc(1, 65536);
+    data->dst = (unsigned char*)malloc(65536);
+}
+
+CTEST_TEARDOWN(benchdata) {
+    free(data->src);
+    free(data->dst);
+}
+
+CTEST2_BENCH(benchdata, memcpy_64k) {
+    for (size_t i = 0; i < iterations; i++) {
+        memcpy(data->dst, data->src, 65536);
+        CTEST_BENCH_KEEP(data->dst);
+    }
+}
+
+// ASSERT_EQUAL checks inline and only calls out of line on failure, compare
+// with calling the assert_equal() function for every check
+CTEST_BENCH(bench, assert_equal_call) {
+    volatile intmax_t value = 42;
+    for (size_t i = 0; i < iterations; i++) {
+        assert_equal(42, value, __FILE__, __LINE__);
+    }
+}
+
+CTEST_BENCH(bench, assert_equal_inline) {
+    volatile intmax_t value = 42;
+    for (size_t i = 0; i < iterations; i++) {
+        ASSERT_EQUAL(42, value);
+    }
+}
+
+// ASSERT_DATA over growing buffer sizes, against a plain byte loop
+static unsigned char* bench_data_buffer(size_t size, int which) {
+    static unsigned char* buffers[2];
+    static size_t sizes[2];
+    if (sizes[which] < size) {
+        free(buffers[which]);
+        buffers[which] = (unsigned char*)malloc(size);
+        if (buffers[which] == NULL) ASSERT_FAIL();
+        memset(buffers[which], 0x5a, size);   // touch the pages
+        sizes[which] = size;
+    }
+    return buffers[which];
+}
+
+static void bench_assert_data(size_t size, size_t iterations) {
+    unsigned char* a = bench_data_buffer(size, 0);
+    unsigned char* b = bench_data_buffer(size, 1);
+    for (size_t i = 0; i < iterations; i++) {
+        ASSERT_DATA(a, size, b, size);
+    }
+}
+
+// volatile keeps the compiler from vectorizing the loop, it's the scalar baseline
+static void bench_byte_loop(size_t size, size_t iterations) {
+    const volatile unsigned char* a = bench_data_buffer(size, 0);
+    const volatile unsigned char* b = bench_data_buffer(size, 1);
+    for (size_t i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < size; j++) {
+            if (a[j] != b[j]) ASSERT_FAIL();
+        }
+    }
+}
+
+CTEST_BENCH(assert_data, size_64) { bench_assert_data(64, iterations); }
+CTEST_BENCH(assert_data, size_4k) { bench_assert_data(4096, iterations); }
+CTEST_BENCH(assert_data, size_1m) { bench_assert_data(1 << 20, iterations); }
+CTEST_BENCH(assert_data, size_64m) { bench_assert_data(64 << 20, iterations); }
+CTEST_BENCH(assert_data, size_1g) { bench_assert_data(1 << 30, iterations); }
+CTEST_BENCH(assert_data, byte_loop_64) { bench_byte_loop(64, iterations); }
+CTEST_BENCH(assert_data, byte_loop_4k) { bench_byte_loop(4096, iterations); }
+CTEST_BENCH(assert_data, byte_loop_1m) { bench_byte_loop(1 << 20, iterations); }
+CTEST_BENCH(assert_data, byte_loop_64m) { bench_byte_loop(64 << 20, iterations); }
+CTEST_BENCH(assert_data, byte_loop_1g) { bench_byte_loop(1 << 30, iterations); }